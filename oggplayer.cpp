@@ -1,11 +1,20 @@
 // Copyright (C) 2009, Chris Double. All Rights Reserved.
 // See the license at the end of this file.
 #include <cstring>
+#include <cstdio>
+#include <climits>
 #include <cmath>
 #include <cstdlib>
+#include <csignal>
 #include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+#include <limits>
 #include <sstream>
 #include <vector>
+#include <list>
+#include <map>
 #include <string>
 #include <oggplay/oggplay.h>
 #include <oggplay/oggplay_tools.h>
@@ -13,11 +22,28 @@
 #include <boost/scoped_array.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <SDL/SDL.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <cerrno>
+#include <dirent.h>
+#include <strings.h>
+#include <unistd.h>
 
 extern "C" {
 #include <sydney_audio.h>
 }
 
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define OGGPLAYER_X86 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+
 #define UNSELECTED -2
 
 using namespace std;
@@ -33,14 +59,14 @@ shared_ptr<T> msp(T* t) {
 // Wrap some of the SDL functionality to help manage resources
 class SDL {
   public:
-    SDL(unsigned long flags = 0) : init_flags(flags), initialized(false), use_sdl_yuv(false), fuzz_mode(false) {
+    SDL(unsigned long flags = 0) : init_flags(flags), initialized(false), use_sdl_yuv(false), fuzz_mode(false),
+                                   audio_sync(true), present_direct(true), convert_ahead(true) {
       int r = SDL_Init(init_flags | SDL_INIT_NOPARACHUTE);
       assert(r == 0);
     }
 
     ~SDL() {
       if (initialized) {
-        yuv_surface.reset();
         SDL_Quit();
       }
     }
@@ -55,9 +81,19 @@ class SDL {
                                      SDL_FreeSurface);
     }
 
+    // True once the video subsystem, and with it the event queue, is running
+    bool hasVideo() const {
+      return initialized;
+    }
+
     bool use_sdl_yuv;
     bool fuzz_mode;
-    shared_ptr<SDL_Overlay> yuv_surface;
+    bool audio_sync;
+    // Write RGB frames straight into the screen when its format allows
+    bool present_direct;
+    // Convert frames before waiting for their presentation time, leaving
+    // only the flip for the deadline
+    bool convert_ahead;
 
   private:
     unsigned long init_flags;
@@ -67,6 +103,448 @@ class SDL {
 // The SDL routines are accessible globally
 SDL gSDL;
 
+// Microseconds since an arbitrary starting point, for timing things.
+inline int64_t now_us() {
+  static ptime epoch(microsec_clock::universal_time());
+  return (microsec_clock::universal_time() - epoch).total_microseconds();
+}
+
+// Distribution of durations in microseconds. Values below 16 get a bucket
+// each, above that there are 16 logarithmically spaced buckets per power of
+// two. Percentiles are therefore accurate to within about 6% and memory use
+// is fixed however many values are recorded.
+class Histogram {
+public:
+  enum {
+    SUB_BUCKETS = 16,
+    NUM_BUCKETS = SUB_BUCKETS * 34
+  };
+
+public:
+  Histogram() {
+    reset();
+  }
+
+  void reset() {
+    memset(mCounts, 0, sizeof(mCounts));
+    mCount = 0;
+    mTotal = 0;
+    mMax = 0;
+  }
+
+  // Safe to call from several threads at once.
+  void record(int64_t us) {
+    uint64_t v = us < 0 ? 0 : us;
+    __sync_fetch_and_add(&mCounts[bucketFor(v)], 1);
+    __sync_fetch_and_add(&mCount, 1);
+    __sync_fetch_and_add(&mTotal, v);
+    uint64_t old = mMax;
+    while (v > old && !__sync_bool_compare_and_swap(&mMax, old, v))
+      old = mMax;
+  }
+
+  uint64_t count() const {
+    return mCount;
+  }
+
+  uint64_t total() const {
+    return mTotal;
+  }
+
+  uint64_t max() const {
+    return mMax;
+  }
+
+  double mean() const {
+    return mCount ? static_cast<double>(mTotal) / mCount : 0.0;
+  }
+
+  // Returns the value below which a proportion 'p' (0 to 1) of the recorded
+  // values fall.
+  uint64_t percentile(double p) const {
+    if (mCount == 0)
+      return 0;
+    uint64_t wanted = static_cast<uint64_t>(ceil(p * mCount));
+    if (wanted == 0)
+      wanted = 1;
+    uint64_t seen = 0;
+    for (int i=0; i < NUM_BUCKETS; ++i) {
+      seen += mCounts[i];
+      if (seen >= wanted)
+        return std::min(bucketValue(i), mMax);
+    }
+    return mMax;
+  }
+
+  // One line summary: count, mean and the usual percentiles.
+  string toString() const {
+    ostringstream str;
+    str << "n=" << mCount << " mean=" << static_cast<int64_t>(mean())
+        << "us p50=" << percentile(0.5) << "us p95=" << percentile(0.95)
+        << "us p99=" << percentile(0.99) << "us max=" << mMax << "us";
+    return str.str();
+  }
+
+  string toJSON() const {
+    ostringstream str;
+    str << "{\"count\":" << mCount << ",\"mean_us\":" << mean()
+        << ",\"p50_us\":" << percentile(0.5) << ",\"p95_us\":" << percentile(0.95)
+        << ",\"p99_us\":" << percentile(0.99) << ",\"max_us\":" << mMax << "}";
+    return str.str();
+  }
+
+private:
+  static int bucketFor(uint64_t v) {
+    if (v < SUB_BUCKETS)
+      return v;
+    int octave = 63 - __builtin_clzll(v);
+    int sub = (v >> (octave - 4)) & (SUB_BUCKETS - 1);
+    return std::min((octave - 3) * SUB_BUCKETS + sub, NUM_BUCKETS - 1);
+  }
+
+  // Midpoint of the range of values a bucket holds
+  static uint64_t bucketValue(int bucket) {
+    if (bucket < SUB_BUCKETS)
+      return bucket;
+    int octave = bucket / SUB_BUCKETS + 3;
+    uint64_t sub = bucket % SUB_BUCKETS;
+    uint64_t low = (SUB_BUCKETS + sub) << (octave - 4);
+    uint64_t high = (SUB_BUCKETS + sub + 1) << (octave - 4);
+    return (low + high - 1) / 2;
+  }
+
+  uint64_t mCounts[NUM_BUCKETS];
+  uint64_t mCount;
+  uint64_t mTotal;
+  uint64_t mMax;
+};
+
+// Process wide counts of read system calls and page faults, for comparing
+// how the OggPlayReaders get at the file. The read counts come from
+// /proc/self/io and are -1 where that doesn't exist.
+struct IOCounters {
+  IOCounters() : syscr(-1), rchar(-1), majorFaults(0), minorFaults(0) { }
+
+  void sample() {
+    ifstream in("/proc/self/io");
+    string name;
+    int64_t value;
+    while (in >> name >> value) {
+      if (name == "syscr:")
+        syscr = value;
+      else if (name == "rchar:")
+        rchar = value;
+    }
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+      majorFaults = usage.ru_majflt;
+      minorFaults = usage.ru_minflt;
+    }
+  }
+
+  int64_t syscr;
+  int64_t rchar;
+  long majorFaults;
+  long minorFaults;
+};
+
+// Throughput and per-stage latency gathered in --benchmark mode, which runs
+// the decode loop headless and as fast as possible.
+class Benchmark {
+public:
+  Benchmark()
+    : enabled(false),
+      videoFrames(0),
+      audioSamples(0),
+      audioChannels(0),
+      startUs(0),
+      endUs(0),
+      reader("file"),
+      inputBytes(0)
+  {
+  }
+
+  void start() {
+    startUs = now_us();
+    if (enabled)
+      startIO.sample();
+  }
+
+  void end() {
+    endUs = now_us();
+    if (enabled)
+      endIO.sample();
+  }
+
+  void report() const {
+    double seconds = (endUs - startUs) / 1000000.0;
+    if (seconds <= 0)
+      seconds = 1e-6;
+
+    cout << "Benchmark: " << seconds << " s" << endl;
+    cout << "  decoded video: " << videoFrames << " frames, " << videoFrames / seconds << " fps" << endl;
+    cout << "  decoded audio: " << audioSamples << " samples x " << audioChannels << " channels, "
+         << audioSamples / seconds << " samples/s" << endl;
+    cout << "  decode step:      " << decode.toString() << endl;
+    cout << "  yuv conversion:   " << yuv.toString() << endl;
+    if (scale.count() > 0)
+      cout << "  yuv scaling:      " << scale.toString() << endl;
+    cout << "  audio conversion: " << audio.toString() << endl;
+
+    int64_t syscalls = endIO.syscr - startIO.syscr;
+    int64_t read_bytes = endIO.rchar - startIO.rchar;
+    long major_faults = endIO.majorFaults - startIO.majorFaults;
+    long minor_faults = endIO.minorFaults - startIO.minorFaults;
+    cout << "  " << reader << " reader: " << inputBytes / seconds / (1024 * 1024) << " MB/s, ";
+    if (endIO.syscr != -1)
+      cout << syscalls << " read calls for " << read_bytes << " bytes, ";
+    cout << major_faults << " major and " << minor_faults << " minor page faults" << endl;
+
+    // Single line of JSON for scripts to pick up
+    cout << "{\"seconds\":" << seconds
+         << ",\"video_frames\":" << videoFrames
+         << ",\"decoded_fps\":" << videoFrames / seconds
+         << ",\"audio_samples\":" << audioSamples
+         << ",\"audio_channels\":" << audioChannels
+         << ",\"audio_samples_per_second\":" << audioSamples / seconds
+         << ",\"reader\":\"" << reader << "\""
+         << ",\"input_bytes\":" << inputBytes
+         << ",\"input_bytes_per_second\":" << inputBytes / seconds
+         << ",\"read_syscalls\":" << (endIO.syscr != -1 ? syscalls : -1)
+         << ",\"read_bytes\":" << (endIO.rchar != -1 ? read_bytes : -1)
+         << ",\"major_faults\":" << major_faults
+         << ",\"minor_faults\":" << minor_faults
+         << ",\"latency\":{\"decode\":" << decode.toJSON()
+         << ",\"yuv_conversion\":" << yuv.toJSON()
+         << ",\"yuv_scaling\":" << scale.toJSON()
+         << ",\"audio_conversion\":" << audio.toJSON() << "}}" << endl;
+  }
+
+  bool enabled;
+
+  // Time spent in each oggplay_step_decoding() call
+  Histogram decode;
+
+  // Time to convert one video frame to RGB
+  Histogram yuv;
+
+  // Time to scale one video frame down for --size
+  Histogram scale;
+
+  // Time to convert one audio record to S16
+  Histogram audio;
+
+  unsigned long videoFrames;
+  uint64_t audioSamples;
+  int audioChannels;
+  int64_t startUs;
+  int64_t endUs;
+  IOCounters startIO;
+  IOCounters endIO;
+
+  // Name of the OggPlayReader used, and the size of the file it read
+  const char* reader;
+  int64_t inputBytes;
+};
+
+Benchmark gBenchmark;
+
+// Hot path instrumentation: counters and timing histograms for the decode
+// thread, the buffer retrieve/release cycle and the per-frame handlers.
+// Dumped to stderr on SIGUSR1 and at exit. Build with -DOGGPLAYER_NO_STATS
+// to compile it all out.
+class Stats {
+public:
+  enum Counter {
+    DECODE_STEPS,
+    DECODE_FRAMES,
+    DECODE_TIMEOUTS,
+    // Timeouts retried straight away
+    DECODE_SPINS,
+    // Timeouts followed by a sleep
+    DECODE_BACKOFFS,
+    // Times the decode thread parked because the buffer was full
+    DECODE_PARKS,
+    BUFFERS_RETRIEVED,
+    BUFFERS_EMPTY,
+    VIDEO_FRAMES,
+    AUDIO_RECORDS,
+    AUDIO_SAMPLES,
+    // Times the sound device played everything written to it before the
+    // audio thread had more
+    AUDIO_UNDERRUNS,
+    // Times the main loop waited for space in the audio ring
+    AUDIO_RING_WAITS,
+    SEEKBAR_DRAWS,
+    NUM_COUNTERS
+  };
+
+  enum Timer {
+    // oggplay_step_decoding() calls made with free buffer slots
+    DECODE_STEP,
+    // oggplay_step_decoding() calls made with the buffer full, which block
+    // until the main loop releases a slot
+    DECODE_STALL,
+    // Decode thread parked waiting for a free buffer slot
+    DECODE_PARKED,
+    // Decode thread sleeping after repeated timeouts
+    DECODE_BACKOFF,
+    BUFFER_RETRIEVE,
+    BUFFER_RELEASE,
+    // Main loop idle, waiting for the decoder
+    MAIN_WAIT,
+    VIDEO_FRAME,
+    YUV_CONVERT,
+    YUV_SCALE,
+    // Cropping a new subtitle bitmap, and blending it onto a frame
+    SUBTITLE_CACHE,
+    SUBTITLE_BLEND,
+    AUDIO_RECORD,
+    AUDIO_CONVERT,
+    // sa_stream_write() calls on the audio thread
+    AUDIO_WRITE,
+    // Audio queued in the ring but not yet written to the device, sampled
+    // each time the main loop queues more
+    AUDIO_LAG,
+    SEEKBAR_DRAW,
+    NUM_TIMERS
+  };
+
+#ifdef OGGPLAYER_NO_STATS
+  static const bool enabled = false;
+
+  void count(Counter, long = 1) { }
+  void record(Timer, int64_t) { }
+  void setBufferCapacity(int) { }
+  void bufferFilled() { }
+  void bufferEmptied() { }
+  void bufferReset() { }
+  void requestDump() { }
+  void dumpIfRequested() { }
+  void dump() const { }
+#else
+  static const bool enabled = true;
+
+  Stats() : mCapacity(0), mOccupancy(0), mPeakOccupancy(0), mDumpRequested(0) {
+    memset(mCounters, 0, sizeof(mCounters));
+  }
+
+  void count(Counter counter, long n = 1) {
+    __sync_fetch_and_add(&mCounters[counter], n);
+  }
+
+  void record(Timer timer, int64_t us) {
+    mTimers[timer].record(us);
+  }
+
+  // Track how many of the liboggplay buffer slots hold decoded data. Only
+  // one Decoder at a time reports to these, see Decoder::shareStats().
+  void setBufferCapacity(int capacity) {
+    mCapacity = capacity;
+  }
+
+  void bufferFilled() {
+    long n = __sync_add_and_fetch(&mOccupancy, 1);
+    if (n > mPeakOccupancy)
+      mPeakOccupancy = n;
+  }
+
+  void bufferEmptied() {
+    if (__sync_sub_and_fetch(&mOccupancy, 1) < 0)
+      mOccupancy = 0;
+  }
+
+  // A seek discards everything in the buffer
+  void bufferReset() {
+    mOccupancy = 0;
+  }
+
+  // Called from the signal handler, so only sets a flag. The main loop does
+  // the dump.
+  void requestDump() {
+    mDumpRequested = 1;
+  }
+
+  void dumpIfRequested() {
+    if (mDumpRequested) {
+      mDumpRequested = 0;
+      dump();
+    }
+  }
+
+  void dump() const {
+    static const char* counters[] = {
+      "decode.steps", "decode.frames", "decode.timeouts",
+      "decode.spins", "decode.backoffs", "decode.parks",
+      "buffer.retrieved", "buffer.empty",
+      "video.frames", "audio.records", "audio.samples", "audio.underruns",
+      "audio.ring_waits", "seekbar.draws"
+    };
+    static const char* timers[] = {
+      "decode.step", "decode.stall", "decode.parked", "decode.backoff",
+      "buffer.retrieve", "buffer.release", "main.wait",
+      "video.frame", "video.yuv_convert", "video.yuv_scale", "video.subtitle_cache",
+      "video.subtitle_blend", "audio.record", "audio.convert", "audio.write", "audio.lag",
+      "seekbar.draw"
+    };
+
+    cerr << "oggplayer stats:" << endl;
+    for (int i=0; i < NUM_COUNTERS; ++i)
+      cerr << "  " << counters[i] << " = " << mCounters[i] << endl;
+    cerr << "  buffer.occupancy = " << mOccupancy << "/" << mCapacity
+         << " (peak " << mPeakOccupancy << ")" << endl;
+    cerr << "  decode.stall_ms = " << mTimers[DECODE_STALL].total() / 1000 << endl;
+    for (int i=0; i < NUM_TIMERS; ++i) {
+      if (mTimers[i].count() > 0)
+        cerr << "  " << timers[i] << ": " << mTimers[i].toString() << endl;
+    }
+  }
+
+private:
+  long mCounters[NUM_COUNTERS];
+  Histogram mTimers[NUM_TIMERS];
+  long mCapacity;
+  long mOccupancy;
+  long mPeakOccupancy;
+  volatile sig_atomic_t mDumpRequested;
+#endif
+};
+
+Stats gStats;
+
+// Times a stage into the stats surface and, in --benchmark mode, into one of
+// the benchmark's histograms. Costs nothing beyond testing the benchmark
+// flag when neither wants the timing.
+class StageTimer {
+public:
+  StageTimer(Stats::Timer timer, Histogram* benchmark = 0)
+    : mTimer(timer),
+      mBenchmark(gBenchmark.enabled ? benchmark : 0),
+      mStart(Stats::enabled || mBenchmark ? now_us() : 0)
+  {
+  }
+
+  ~StageTimer() {
+    if (Stats::enabled || mBenchmark) {
+      int64_t us = now_us() - mStart;
+      gStats.record(mTimer, us);
+      if (mBenchmark)
+        mBenchmark->record(us);
+    }
+  }
+
+private:
+  Stats::Timer mTimer;
+  Histogram* mBenchmark;
+  int64_t mStart;
+};
+
+#ifdef SIGUSR1
+void handle_sigusr1(int) {
+  gStats.requestDump();
+}
+#endif
+
 class Track {
   public:
     shared_ptr<OggPlay> mPlayer;
@@ -153,18 +631,25 @@ shared_ptr<Track> handle_theora_metadata(shared_ptr<OggPlay> player, int index)
   return msp(new TheoraTrack(player, index, static_cast<float>(num) / denom));
 }
 
+shared_ptr<Track> make_vorbis_track(shared_ptr<OggPlay> player, int index, int rate, int channels) {
+  // The offset delivers audio 250ms ahead of the video it accompanies, which
+  // covers the sound device's latency when syncing against the system clock.
+  // The value comes from the oggplay examples. When syncing against the audio
+  // clock the device position already accounts for latency, and the offset
+  // would skew the presentation times the clock is based on.
+  if (!gSDL.audio_sync)
+    oggplay_set_offset(player.get(), index, 250);
+
+  return msp(new VorbisTrack(player,index, rate, channels));
+}
+
 shared_ptr<Track> handle_vorbis_metadata(shared_ptr<OggPlay> player, int index) {
   int rate, channels;
   int r = oggplay_get_audio_samplerate(player.get(), index, &rate);
   assert(r == E_OGGPLAY_OK);
   r = oggplay_get_audio_channels(player.get(), index, &channels);
   assert(r == E_OGGPLAY_OK);
-
-  // What does this do??? Seems to be needed for audio to sync with system clock
-  // and the value comes from the oggplay examples.
-  oggplay_set_offset(player.get(), index, 250);
-
-  return msp(new VorbisTrack(player,index, rate, channels));
+  return make_vorbis_track(player, index, rate, channels);
 }
 
 shared_ptr<Track> handle_kate_metadata(shared_ptr<OggPlay> player, int index) {
@@ -226,100 +711,1466 @@ shared_ptr<TrackType> get_track(int trackidx, InputIterator first, InputIterator
   return shared_ptr<TrackType>();
 }
 
-int decode_thread(void* p);
+// How much decoded data the decode thread may buffer ahead of playback.
+struct BufferPolicy {
+  BufferPolicy()
+    : budgetMB(0),
+      minDepth(4),
+      startMs(500),
+      maxMs(2000),
+      defaultBudgetMB(256)
+  {
+  }
 
-// Encapsulates the decode thread and seeking operations.
-class Decoder {
+  // Memory for decoded data set with --buffer-budget. With no budget the
+  // depth is limited to 'maxMs' of playback, within 'defaultBudgetMB'.
+  long budgetMB;
+
+  // Never buffer fewer slots than this
+  int minDepth;
+
+  // Playback time to buffer before any jitter has been measured
+  long startMs;
+
+  long maxMs;
+  long defaultBudgetMB;
+};
+
+BufferPolicy gBufferPolicy;
+
+// Works out what one liboggplay buffer slot holds for the active tracks:
+// its size in bytes and the playback time it covers. This must agree with
+// the callback setup in activate_tracks().
+void buffer_slot_size(shared_ptr<TheoraTrack> video, shared_ptr<VorbisTrack> audio,
+                      shared_ptr<KateTrack> kate, size_t& bytes, int64_t& periodUs) {
+  bytes = 0;
+  periodUs = 40000;
+
+  if (video) {
+    shared_ptr<OggPlay> player(video->mPlayer);
+    int y_width = 0, y_height = 0, uv_width = 0, uv_height = 0;
+    oggplay_get_video_y_size(player.get(), video->mIndex, &y_width, &y_height);
+    oggplay_get_video_uv_size(player.get(), video->mIndex, &uv_width, &uv_height);
+    bytes += static_cast<size_t>(y_width) * y_height + 2 * static_cast<size_t>(uv_width) * uv_height;
+    // A slot may also hold a subtitle bitmap rendered at the frame size
+    if (kate)
+      bytes += static_cast<size_t>(y_width) * y_height * 4;
+    if (video->mFramerate > 0)
+      periodUs = static_cast<int64_t>(1000000 / video->mFramerate);
+  }
+  else if (kate) {
+    // Rendered by tiger into a 640x480 RGBA bitmap
+    bytes += 640 * 480 * 4;
+  }
+
+  if (audio && audio->mRate > 0) {
+    int64_t samples = video ? audio->mRate * periodUs / 1000000 : 2048;
+    if (!video)
+      periodUs = samples * 1000000 / audio->mRate;
+    bytes += static_cast<size_t>(samples) * audio->mChannels * sizeof(float);
+  }
+
+  if (bytes == 0)
+    bytes = 1;
+}
+
+// Chooses how many slots of the liboggplay buffer the decode thread may
+// fill. The buffer is created with the most slots the memory budget allows,
+// which only costs a pointer each, and the depth actually used moves within
+// that as decode jitter is measured.
+//
+// Jitter is measured as the decoder's largest deficit against real time
+// over a window of about two seconds: decode times over the slot's playback
+// period accumulate, and faster ones pay it back. The buffer needs enough
+// slots to cover that deficit, plus some margin. The depth grows straight
+// away and shrinks by at most a quarter each window.
+class BufferSizer {
 public:
-  Decoder(shared_ptr<OggPlay> player)
+  BufferSizer(const BufferPolicy& policy, size_t slotBytes, int64_t periodUs)
+    : mSlotBytes(slotBytes),
+      mPeriodUs(std::max(periodUs, static_cast<int64_t>(1000))),
+      mWindow(0),
+      mWindowFrames(0),
+      mDeficitUs(0),
+      mWindowMaxDeficitUs(0),
+      mAdjustments(0)
+  {
+    int64_t budget = (policy.budgetMB > 0 ? policy.budgetMB : policy.defaultBudgetMB) << 20;
+    mMaxDepth = static_cast<int>(std::min(budget / static_cast<int64_t>(mSlotBytes),
+                                          static_cast<int64_t>(MAX_DEPTH)));
+    if (policy.budgetMB == 0)
+      mMaxDepth = std::min(mMaxDepth, std::max(slotsFor(policy.maxMs * 1000), policy.minDepth));
+    // Double buffer at least, even if that goes over a tiny budget
+    mMaxDepth = std::max(mMaxDepth, 2);
+    mMinDepth = std::min(policy.minDepth, mMaxDepth);
+    mDepth = clamp(slotsFor(policy.startMs * 1000));
+    mWindow = std::max(slotsFor(2000000), 8);
+  }
+
+  // Slots to give oggplay_use_buffer()
+  int maxDepth() const {
+    return mMaxDepth;
+  }
+
+  // Slots the decode thread should fill
+  int depth() const {
+    return mDepth;
+  }
+
+  // Called by the decode thread each time it has filled a slot, with the
+  // time taken to decode it. Returns the new depth.
+  int frameDecoded(int64_t us) {
+    mDeficitUs = std::max(mDeficitUs + us - mPeriodUs, static_cast<int64_t>(0));
+    mWindowMaxDeficitUs = std::max(mWindowMaxDeficitUs, mDeficitUs);
+    if (++mWindowFrames < mWindow)
+      return mDepth;
+
+    // Cover the worst deficit with half as much again to spare
+    int needed = clamp(slotsFor(mWindowMaxDeficitUs * 3 / 2) + 2);
+    int depth = mDepth;
+    if (needed > mDepth)
+      depth = needed;
+    else if (needed < mDepth)
+      depth = std::max(needed, mDepth - std::max(mDepth / 4, 1));
+    if (depth != mDepth) {
+      mDepth = depth;
+      ++mAdjustments;
+    }
+    mWindowFrames = 0;
+    mWindowMaxDeficitUs = mDeficitUs;
+    return mDepth;
+  }
+
+  // 'peakSlots' is the most slots that were filled at once
+  void report(int peakSlots) const {
+    cout << "Decode buffer: depth " << mDepth << " (" << mMinDepth << "-" << mMaxDepth
+         << ", " << mAdjustments << " adjustments), "
+         << mSlotBytes / 1024 << " KB and " << mPeriodUs / 1000 << " ms per slot" << endl;
+    cout << "  peak " << (static_cast<uint64_t>(peakSlots) * mSlotBytes) / 1024
+         << " KB held in " << peakSlots << " decoded slots" << endl;
+  }
+
+private:
+  enum { MAX_DEPTH = 1024 };
+
+  int slotsFor(int64_t us) const {
+    return static_cast<int>(std::min((us + mPeriodUs - 1) / mPeriodUs,
+                                     static_cast<int64_t>(MAX_DEPTH)));
+  }
+
+  int clamp(int depth) const {
+    return std::min(std::max(depth, mMinDepth), mMaxDepth);
+  }
+
+  size_t mSlotBytes;
+  int64_t mPeriodUs;
+  int mMinDepth;
+  int mMaxDepth;
+  int mDepth;
+
+  int mWindow;
+  int mWindowFrames;
+  int64_t mDeficitUs;
+  int64_t mWindowMaxDeficitUs;
+  long mAdjustments;
+};
+
+// Index of Theora keyframes, from media time to the byte offset of the page
+// each keyframe starts on. It's built by reading the file's pages in a
+// background thread after it is opened, so that seeks can give liboggplay a
+// narrow range to search rather than bisecting the whole file. Entries can
+// be used as soon as they are added. Only local files are indexed.
+class KeyframeIndex {
+public:
+  KeyframeIndex()
     : mThread(0),
-      mPlayer(player),
-      mCompleted(false)
+      mLock(SDL_CreateMutex()),
+      mStopping(0),
+      mComplete(false),
+      mLoaded(false),
+      mIndexedMs(-1),
+      mIndexedOffset(0),
+      mFileSize(0),
+      mPages(0),
+      mBuildUs(0)
   {
   }
-  
-  ~Decoder() {
+
+  ~KeyframeIndex() {
+    stop();
+    SDL_DestroyMutex(mLock);
   }
-  
-  bool start() {
+
+  // Start indexing 'path' in the background. Returns false if it isn't a
+  // local file.
+  bool start(const string& path) {
     assert(!mThread);
-    setCompleted(false);
-    mThread = SDL_CreateThread(decode_thread, this);
-    return mThread != 0;  
+    if (path.compare(0, 7, "http://") == 0)
+      return false;
+    mPath = path;
+    mThread = SDL_CreateThread(index_thread, this);
+    return mThread != 0;
   }
-  
-  bool stop() {
-    setCompleted(true);
-    // We need to release a buffer, as oggplay_step_decode() could be blocked
-    // waiting for a free buffer.
-    OggPlayCallbackInfo** info = oggplay_buffer_retrieve_next(mPlayer.get());
-    if (info) {
-      oggplay_buffer_release(mPlayer.get(), info);
-    }
+
+  void stop() {
+    if (!mThread)
+      return;
+    __sync_fetch_and_or(&mStopping, 1);
     SDL_WaitThread(mThread, NULL);
     mThread = 0;
   }
 
-  OggPlay* getPlayer() {
-    return mPlayer.get();
+  struct Entry {
+    int64_t ms;
+    int64_t offset;
+  };
+
+  // Use 'entries', for a file of 'fileSize' bytes, rather than building the
+  // index.
+  void load(const vector<Entry>& entries, int64_t fileSize) {
+    assert(!mThread);
+    SDL_LockMutex(mLock);
+    mEntries = entries;
+    mFileSize = fileSize;
+    mComplete = true;
+    mLoaded = true;
+    SDL_UnlockMutex(mLock);
   }
 
-  bool isCompleted() {
-    return mCompleted;
+  // Copies the index to 'entries' if it is complete
+  bool entries(vector<Entry>& entries, int64_t& fileSize) {
+    SDL_LockMutex(mLock);
+    bool complete = mComplete;
+    if (complete) {
+      entries = mEntries;
+      fileSize = mFileSize;
+    }
+    SDL_UnlockMutex(mLock);
+    return complete;
   }
 
-  void seek(long target) {  
-    stop();
-    oggplay_seek(mPlayer.get(), target);
-    start();
-    mJustSeeked = true;
+  // Finds the range of the file holding the keyframe before media time 'ms'
+  // and the frames up to 'ms'. Returns false if that part of the file isn't
+  // indexed yet.
+  bool lookup(int64_t ms, int64_t& begin, int64_t& end) {
+    SDL_LockMutex(mLock);
+    bool found = false;
+    if (!mEntries.empty() && (mComplete || ms <= mIndexedMs)) {
+      vector<Entry>::iterator it = upper_bound(mEntries.begin(), mEntries.end(), ms, entry_after);
+      if (it != mEntries.begin()) {
+        begin = (it - 1)->offset;
+        end = it != mEntries.end() ? it->offset : (mComplete ? mFileSize : mIndexedOffset);
+        found = true;
+      }
+    }
+    SDL_UnlockMutex(mLock);
+    return found;
   }
-  
 
-  void setCompleted(bool c) {
-    mCompleted = c;
+  void report() {
+    SDL_LockMutex(mLock);
+    if (mLoaded) {
+      cout << "Keyframe index: " << mEntries.size() << " keyframes, loaded from cache" << endl;
+    }
+    else if (mComplete) {
+      cout << "Keyframe index: " << mEntries.size() << " keyframes from " << mPages << " pages, "
+           << (mEntries.size() * sizeof(Entry)) / 1024 << " KB, built in "
+           << mBuildUs / 1000 << " ms" << endl;
+    }
+    else {
+      cout << "Keyframe index: incomplete, " << mEntries.size() << " keyframes up to "
+           << mIndexedMs << " ms" << endl;
+    }
+    SDL_UnlockMutex(mLock);
   }
 
-  bool justSeeked() {
-    if (mJustSeeked) {
-      mJustSeeked = false;
-      return true;
+private:
+  static bool entry_after(int64_t ms, const Entry& entry) {
+    return ms < entry.ms;
+  }
+
+  static int index_thread(void* data) {
+    static_cast<KeyframeIndex*>(data)->build();
+    return 0;
+  }
+
+  static uint32_t read_le32(const unsigned char* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+  }
+
+  static uint32_t read_be32(const unsigned char* p) {
+    return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+  }
+
+  // Reads the next page header and segment table at or after 'offset',
+  // leaving the file at the start of the page body. 'offset' is updated to
+  // where the page starts.
+  static bool read_page_header(FILE* file, off_t& offset, unsigned char* header, unsigned char* segments) {
+    while (fread(header, 1, 27, file) == 27) {
+      if (memcmp(header, "OggS", 4) == 0) {
+        return header[26] == 0 || fread(segments, 1, header[26], file) == header[26];
+      }
+      // Lost sync. Look for the next capture pattern.
+      if (fseeko(file, ++offset, SEEK_SET) != 0)
+        return false;
     }
     return false;
   }
 
+  void build() {
+    int64_t start = now_us();
+    FILE* file = fopen(mPath.c_str(), "rb");
+    if (!file) {
+      finish(0, start);
+      return;
+    }
+
+    // Theora stream being indexed, from its identification header
+    bool found = false;
+    uint32_t serial = 0;
+    int shift = 0;
+    int64_t rate_num = 1, rate_den = 1;
+    int first_frame = 0;
+
+    // Page on which the Theora packet still in progress started, and whether
+    // it is a keyframe
+    off_t packet_page = 0;
+    bool packet_key = false;
+
+    // Packets completed on the current page, in order
+    off_t done_page[255];
+    bool done_key[255];
+
+    unsigned char header[27];
+    unsigned char segments[255];
+    unsigned char ident[42];
+    off_t offset = 0;
+    while (!__sync_fetch_and_add(&mStopping, 0) &&
+           read_page_header(file, offset, header, segments)) {
+      int flags = header[5];
+      int64_t granulepos = static_cast<int64_t>(read_le32(header + 6)) |
+                           (static_cast<int64_t>(read_le32(header + 10)) << 32);
+      uint32_t page_serial = read_le32(header + 14);
+      int nsegs = header[26];
+      off_t body_start = ftello(file);
+      size_t body = 0;
+      for (int i=0; i < nsegs; ++i)
+        body += segments[i];
+
+      if (!found && (flags & 0x02) && body >= sizeof(ident) &&
+          fread(ident, 1, sizeof(ident), file) == sizeof(ident) &&
+          memcmp(ident, "\x80theora", 7) == 0) {
+        found = true;
+        serial = page_serial;
+        rate_num = read_be32(ident + 22);
+        rate_den = read_be32(ident + 26);
+        shift = ((ident[40] & 0x03) << 3) | (ident[41] >> 5);
+        // From Theora 3.2.1 granule positions count frames from one
+        first_frame = ident[9] >= 1 ? 1 : 0;
+        if (rate_num == 0)
+          rate_num = 1;
+      }
+      else if (found && page_serial == serial) {
+        // Walk the packet boundaries. A keyframe can end part way through a
+        // page, or span pages, so each packet that starts here has its
+        // first byte read: data packets have the top bit clear, and
+        // keyframes the next one too. Empty packets repeat a frame.
+        bool starting = !(flags & 0x01);
+        size_t position = 0;
+        int done = 0;
+        for (int i=0; i < nsegs; ++i) {
+          if (starting) {
+            packet_page = offset;
+            packet_key = false;
+            int first = segments[i] > 0 && fseeko(file, body_start + position, SEEK_SET) == 0 ?
+                        fgetc(file) : EOF;
+            if (first != EOF)
+              packet_key = (first & 0xc0) == 0;
+          }
+          position += segments[i];
+          starting = segments[i] < 255;
+          if (starting) {
+            done_page[done] = packet_page;
+            done_key[done] = packet_key;
+            ++done;
+          }
+        }
+
+        if (granulepos > 0 && done > 0) {
+          // The granule position gives the frame of the last packet
+          // completed on the page, and each before it is one frame earlier
+          int64_t keyframe = granulepos >> shift;
+          int64_t frames = keyframe + (granulepos - (keyframe << shift));
+          SDL_LockMutex(mLock);
+          for (int j=0; j < done; ++j) {
+            if (!done_key[j])
+              continue;
+            Entry entry;
+            entry.ms = (frames - (done - 1 - j) - first_frame) * 1000 * rate_den / rate_num;
+            entry.offset = done_page[j];
+            mEntries.push_back(entry);
+          }
+          mIndexedMs = (frames - first_frame) * 1000 * rate_den / rate_num;
+          mIndexedOffset = offset;
+          ++mPages;
+          SDL_UnlockMutex(mLock);
+        }
+      }
+
+      offset = body_start + body;
+      if (fseeko(file, offset, SEEK_SET) != 0)
+        break;
+    }
+    fclose(file);
+    finish(offset, start);
+  }
+
+  void finish(int64_t size, int64_t start) {
+    SDL_LockMutex(mLock);
+    mComplete = !__sync_fetch_and_add(&mStopping, 0);
+    mFileSize = size;
+    mBuildUs = now_us() - start;
+    SDL_UnlockMutex(mLock);
+  }
+
 private:
   SDL_Thread* mThread;
-  shared_ptr<OggPlay> mPlayer;
-  bool mCompleted;
-  bool mJustSeeked;
+  SDL_mutex* mLock;
+  volatile int mStopping;
+  string mPath;
+
+  // Protected by mLock
+  vector<Entry> mEntries;
+  bool mComplete;
+  // Set when the entries came from load() rather than being built
+  bool mLoaded;
+  int64_t mIndexedMs;
+  int64_t mIndexedOffset;
+  int64_t mFileSize;
+  long mPages;
+  int64_t mBuildUs;
 };
 
-// Decoding thread. Running the decode loop in a seperate thread avoids the
-// issue where some frames take longer to decode than the time for a frame
-// to be displayed (HD video for example).
-int decode_thread(void* p) {
-  Decoder* d = (Decoder*)p;
-  OggPlay* player = d->getPlayer();
+// Seeks 'player' to media time 'target'. If 'index' covers the target only
+// the range of the file holding the keyframe before it in video track
+// 'track' is searched. Returns true if the index was used.
+bool seek_player(OggPlay* player, KeyframeIndex* index, int track, long target) {
+  int64_t begin, end;
+  if (index && track >= 0 && index->lookup(target, begin, end) &&
+      oggplay_seek_to_keyframe(player, &track, 1, target, begin, end) == E_OGGPLAY_OK)
+    return true;
+  oggplay_seek(player, target);
+  return false;
+}
 
-  // E_OGGPLAY_CONTINUE       = One frame decoded and put in buffer list
-  // E_OGGPLAY_USER_INTERRUPT = One frame decoded, buffer list is now full
-  // E_OGGPLAY_TIMEOUT        = No frames decoded, timed out
-  int r = E_OGGPLAY_TIMEOUT;
-  while (!d->isCompleted() &&
-         (r == E_OGGPLAY_TIMEOUT ||
-         r == E_OGGPLAY_USER_INTERRUPT ||
-         r == E_OGGPLAY_CONTINUE)) {
-    r = oggplay_step_decoding(player);
+// Facts about a file that are slow to find out, which the sidecar cache
+// keeps between runs: its duration, which liboggplay finds by scanning to
+// the end of the file, its tracks and its keyframe index.
+struct MediaInfo {
+  MediaInfo()
+    : durationMs(-1),
+      durationScanUs(0),
+      metadataUs(0),
+      useIndex(true),
+      cached(false),
+      indexCached(false),
+      storing(false)
+  {
   }
-  d->setCompleted(true);
-  return 0;
+
+  // -1 until known
+  int64_t durationMs;
+
+  // How long finding the duration and loading the track metadata took when
+  // the file was last opened without the cache
+  int64_t durationScanUs;
+  int64_t metadataUs;
+
+  vector<shared_ptr<Track> > tracks;
+  KeyframeIndex index;
+
+  // Seeks may use 'index'
+  bool useIndex;
+
+  // Whether the tracks and index came from the cache
+  bool cached;
+  bool indexCached;
+
+  // Set when this will be written to the cache, so that play() finds the
+  // duration if it isn't known
+  bool storing;
+};
+
+// Directory for oggplayer's caches, $XDG_CACHE_HOME/oggplayer or
+// ~/.cache/oggplayer. Empty if neither variable is set.
+string cache_directory() {
+  const char* xdg = getenv("XDG_CACHE_HOME");
+  const char* home = getenv("HOME");
+  if (xdg && *xdg)
+    return string(xdg) + "/oggplayer";
+  if (home && *home)
+    return string(home) + "/.cache/oggplayer";
+  return string();
 }
 
-// Displays onscreen a bar which indicates how far through the media playback
-// has reached. You can click on the seek bar to seek. Seek bar is visible when
-// the mouse hovers over it, or for a number of seconds after last mouse motion.
-class SeekBar {
+// Creates 'dir' and its parent if they don't exist
+void make_cache_directory(const string& dir) {
+  size_t slash = dir.rfind('/');
+  if (slash != string::npos && slash > 0)
+    mkdir(dir.substr(0, slash).c_str(), 0755);
+  mkdir(dir.c_str(), 0755);
+}
+
+// On disk cache of MediaInfo, one file per media file in
+// $XDG_CACHE_HOME/oggplayer (~/.cache/oggplayer by default). Entries are
+// keyed by the file's real path, size and modification time, so an entry is
+// never used for a file that has changed. Only local files are cached.
+class SidecarCache {
+public:
+  SidecarCache() : mDir(cache_directory()), mHits(0), mMisses(0) {
+  }
+
+  // Fills in 'info' for 'path', which has been opened as 'player', from the
+  // cache. Returns false if there is no up to date entry.
+  bool load(const string& path, shared_ptr<OggPlay> player, MediaInfo& info) {
+    Key key;
+    if (!makeKey(path, key))
+      return false;
+
+    ifstream in(key.file.c_str());
+    string magic, cached_path;
+    int64_t size = -1, mtime = -1;
+    MediaInfo loaded;
+    getline(in, magic);
+    getline(in, cached_path);
+    in >> size >> mtime >> loaded.durationMs >> loaded.durationScanUs >> loaded.metadataUs;
+    if (!in || magic != MAGIC || cached_path != key.path || size != key.size || mtime != key.mtime) {
+      ++mMisses;
+      return false;
+    }
+
+    int num_tracks = -1;
+    in >> num_tracks;
+    if (!in || num_tracks != oggplay_get_num_tracks(player.get())) {
+      ++mMisses;
+      return false;
+    }
+    vector<shared_ptr<Track> > tracks;
+    for (int i=0; in && i < num_tracks; ++i) {
+      shared_ptr<Track> track = readTrack(in, player);
+      if (!track)
+        in.setstate(ios::failbit);
+      tracks.push_back(track);
+    }
+
+    long num_keyframes = -1;
+    int64_t file_size = 0;
+    in >> num_keyframes >> file_size;
+    vector<KeyframeIndex::Entry> entries;
+    for (long i=0; in && i < num_keyframes; ++i) {
+      KeyframeIndex::Entry entry;
+      in >> entry.ms >> entry.offset;
+      entries.push_back(entry);
+    }
+    if (!in) {
+      ++mMisses;
+      return false;
+    }
+
+    info.durationMs = loaded.durationMs;
+    info.durationScanUs = loaded.durationScanUs;
+    info.metadataUs = loaded.metadataUs;
+    info.tracks = tracks;
+    info.cached = true;
+    if (num_keyframes >= 0) {
+      info.index.load(entries, file_size);
+      info.indexCached = true;
+    }
+    ++mHits;
+    return true;
+  }
+
+  // Writes 'info' for 'path' to the cache, if it adds anything to what was
+  // loaded.
+  bool store(const string& path, MediaInfo& info) {
+    vector<KeyframeIndex::Entry> entries;
+    int64_t file_size = 0;
+    bool indexed = info.index.entries(entries, file_size);
+    if (info.cached && (info.indexCached || !indexed) && info.durationMs != -1)
+      return true;
+
+    Key key;
+    if (!makeKey(path, key))
+      return false;
+    make_cache_directory(mDir);
+
+    string temp = key.file + ".tmp";
+    {
+      ofstream out(temp.c_str());
+      out << MAGIC << '\n' << key.path << '\n'
+          << key.size << ' ' << key.mtime << ' ' << info.durationMs << ' '
+          << info.durationScanUs << ' ' << info.metadataUs << '\n';
+      out << info.tracks.size() << '\n';
+      for (size_t i=0; i < info.tracks.size(); ++i)
+        writeTrack(out, info.tracks[i]);
+      if (indexed) {
+        out << entries.size() << ' ' << file_size << '\n';
+        for (size_t i=0; i < entries.size(); ++i)
+          out << entries[i].ms << ' ' << entries[i].offset << '\n';
+      }
+      else {
+        out << "-1 0\n";
+      }
+      if (!out) {
+        unlink(temp.c_str());
+        return false;
+      }
+    }
+    return rename(temp.c_str(), key.file.c_str()) == 0;
+  }
+
+  void report(const MediaInfo& info) const {
+    cout << "Sidecar cache: " << mHits << " hits, " << mMisses << " misses";
+    if (info.cached) {
+      cout << ", skipped the duration scan and metadata load, saving about "
+           << (info.durationScanUs + info.metadataUs) / 1000 << " ms";
+    }
+    cout << endl;
+  }
+
+private:
+  static const char* const MAGIC;
+
+  struct Key {
+    string path;
+    string file;
+    int64_t size;
+    int64_t mtime;
+  };
+
+  bool makeKey(const string& path, Key& key) const {
+    struct stat st;
+    char real[PATH_MAX];
+    if (mDir.empty() || path.compare(0, 7, "http://") == 0 ||
+        stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode) ||
+        !realpath(path.c_str(), real))
+      return false;
+
+    key.path = real;
+    key.size = st.st_size;
+    key.mtime = st.st_mtime;
+
+    // FNV-1a hash of the path names the entry
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i=0; i < key.path.size(); ++i) {
+      hash ^= static_cast<unsigned char>(key.path[i]);
+      hash *= 1099511628211ULL;
+    }
+    ostringstream name;
+    name << mDir << '/' << hex << setw(16) << setfill('0') << hash;
+    key.file = name.str();
+    return true;
+  }
+
+  static void writeTrack(ostream& out, shared_ptr<Track> track) {
+    if (shared_ptr<TheoraTrack> theora = dynamic_pointer_cast<TheoraTrack>(track)) {
+      out << "theora " << track->mIndex << ' ' << setprecision(17) << theora->mFramerate << '\n';
+    }
+    else if (shared_ptr<VorbisTrack> vorbis = dynamic_pointer_cast<VorbisTrack>(track)) {
+      out << "vorbis " << track->mIndex << ' ' << vorbis->mRate << ' ' << vorbis->mChannels << '\n';
+    }
+    else if (shared_ptr<KateTrack> kate = dynamic_pointer_cast<KateTrack>(track)) {
+      out << "kate " << track->mIndex << '\n' << kate->mLanguage << '\n' << kate->mCategory << '\n';
+    }
+    else {
+      out << "unknown " << track->mIndex << ' ' << static_cast<int>(track->mType) << '\n';
+    }
+  }
+
+  static shared_ptr<Track> readTrack(istream& in, shared_ptr<OggPlay> player) {
+    string kind;
+    int index = -1;
+    in >> kind >> index;
+    if (!in)
+      return shared_ptr<Track>();
+
+    if (kind == "theora") {
+      double framerate;
+      if (in >> framerate)
+        return msp(new TheoraTrack(player, index, framerate));
+    }
+    else if (kind == "vorbis") {
+      int rate, channels;
+      if (in >> rate >> channels)
+        return make_vorbis_track(player, index, rate, channels);
+    }
+    else if (kind == "kate") {
+      string language, category;
+      in.ignore(numeric_limits<streamsize>::max(), '\n');
+      if (getline(in, language) && getline(in, category))
+        return msp(new KateTrack(player, index, language, category));
+    }
+    else if (kind == "unknown") {
+      int type;
+      if (in >> type)
+        return msp(new UnknownTrack(player, static_cast<OggzStreamContent>(type), index));
+    }
+    return shared_ptr<Track>();
+  }
+
+  string mDir;
+  long mHits;
+  long mMisses;
+};
+
+const char* const SidecarCache::MAGIC = "oggplayer-cache 1";
+
+int decode_thread(void* p);
+
+// Code of the SDL_USEREVENT the decode thread posts when a frame is ready
+#define FRAME_DECODED_EVENT 1
+
+// Encapsulates the decode thread and seeking operations.
+class Decoder {
+public:
+  Decoder(shared_ptr<OggPlay> player)
+    : mThread(0),
+      mPlayer(player),
+      mCompleted(false),
+      mJustSeeked(false),
+      mResult(E_OGGPLAY_OK),
+      mLock(SDL_CreateMutex()),
+      mFramePosted(SDL_CreateCond()),
+      mFramesPosted(0),
+      mEventWaiting(false),
+      mSpaceAvailable(SDL_CreateCond()),
+      mDepth(0),
+      mBuffered(0),
+      mBufferFull(false),
+      mCapacity(0),
+      mSharedStats(true),
+      mTimeouts(0),
+      mPeakBuffered(0),
+      mSizer(0),
+      mIndex(0),
+      mIndexTrack(-1),
+      mThreadExited(false),
+      mSeeking(false),
+      mSeekRunning(false),
+      mSeekDone(SDL_CreateCond()),
+      mSeekPending(false),
+      mSeekTarget(0),
+      mSeekRequestUs(-1),
+      mSeekRequests(0),
+      mSeeksCoalesced(0)
+  {
+  }
+  
+  ~Decoder() {
+    SDL_DestroyCond(mSeekDone);
+    SDL_DestroyCond(mSpaceAvailable);
+    SDL_DestroyCond(mFramePosted);
+    SDL_DestroyMutex(mLock);
+  }
+  
+  bool start() {
+    assert(!mThread);
+    setCompleted(false);
+    mThreadExited = false;
+    mThread = SDL_CreateThread(decode_thread, this);
+    return mThread != 0;  
+  }
+  
+  void stop() {
+    setCompleted(true);
+    // Buffers can't be touched until a seek in progress has finished
+    waitForSeek();
+    // We need to release a buffer, as oggplay_step_decode() could be blocked
+    // waiting for a free buffer
+    OggPlayCallbackInfo** info = oggplay_buffer_retrieve_next(mPlayer.get());
+    if (info) {
+      oggplay_buffer_release(mPlayer.get(), info);
+      bufferReleased();
+    }
+    // Wake the thread if it is parked in waitForSpace() or backing off
+    SDL_LockMutex(mLock);
+    SDL_CondSignal(mSpaceAvailable);
+    SDL_UnlockMutex(mLock);
+    SDL_WaitThread(mThread, NULL);
+    mThread = 0;
+  }
+
+  OggPlay* getPlayer() {
+    return mPlayer.get();
+  }
+
+  bool isCompleted() {
+    return mCompleted;
+  }
+
+  // Seeks use 'index', if it covers the target, to find the keyframe
+  // before it in 'track'. It must outlive the decoder.
+  void setKeyframeIndex(KeyframeIndex* index, int track) {
+    mIndex = index;
+    mIndexTrack = track;
+  }
+
+  // Seeking is asynchronous. requestSeek() only records the target and
+  // wakes the decode thread, which does the seek between decoding steps.
+  // Requests made while a seek is under way replace any that haven't
+  // started, so only the latest target is sought. The main loop gets
+  // buffers through retrieveBuffer(), which leaves them alone while
+  // liboggplay is resetting them.
+  void requestSeek(long target) {
+    SDL_LockMutex(mLock);
+    if (mSeekPending)
+      ++mSeeksCoalesced;
+    ++mSeekRequests;
+    mSeekTarget = target;
+    mSeekRequestUs = now_us();
+    mSeekPending = true;
+    mSeeking = true;
+    // The decode thread may have finished at the end of the stream
+    bool restart = mThreadExited;
+    SDL_CondSignal(mSpaceAvailable);
+    SDL_UnlockMutex(mLock);
+
+    if (restart) {
+      SDL_WaitThread(mThread, NULL);
+      mThread = 0;
+      start();
+    }
+  }
+
+  // Drops any seek that hasn't started and waits for one under way to
+  // finish. Call this before closing the player, after setCompleted(true)
+  // so that no further seek starts.
+  void waitForSeek() {
+    SDL_LockMutex(mLock);
+    mSeekPending = false;
+    while (mSeekRunning)
+      SDL_CondWait(mSeekDone, mLock);
+    mSeeking = false;
+    SDL_UnlockMutex(mLock);
+  }
+
+  // Returns the next buffer for the main loop, or a null pointer if there
+  // isn't one, and sets 'seeking' if a seek has been requested. Until the
+  // decode thread starts the seek, buffers are retrieved and discarded: it
+  // may be blocked in oggplay_step_decoding() on a full buffer and can't get
+  // to the seek until one is released. Once the seek is running they're left
+  // alone. mLock is held across the check and the retrieve so the seek can't
+  // start in between.
+  OggPlayCallbackInfo** retrieveBuffer(bool& seeking) {
+    OggPlayCallbackInfo** info = 0;
+    SDL_LockMutex(mLock);
+    seeking = mSeeking;
+    if (!mSeekRunning) {
+      StageTimer timer(Stats::BUFFER_RETRIEVE);
+      info = oggplay_buffer_retrieve_next(mPlayer.get());
+      if (info && seeking) {
+        oggplay_buffer_release(mPlayer.get(), info);
+        info = 0;
+        spaceReleased();
+      }
+    }
+    SDL_UnlockMutex(mLock);
+    return info;
+  }
+
+  // The most recently requested seek target
+  long seekTarget() {
+    SDL_LockMutex(mLock);
+    long target = mSeekTarget;
+    SDL_UnlockMutex(mLock);
+    return target;
+  }
+
+  // Called by the decode thread between steps. Performs any requested
+  // seeks and returns true if it did.
+  bool seekIfRequested() {
+    bool seeked = false;
+    SDL_LockMutex(mLock);
+    while (mSeekPending && !mCompleted) {
+      long target = mSeekTarget;
+      mSeekPending = false;
+      mSeekRunning = true;
+      SDL_UnlockMutex(mLock);
+      runSeek(target);
+      seeked = true;
+      SDL_LockMutex(mLock);
+      mSeekRunning = false;
+      SDL_CondBroadcast(mSeekDone);
+    }
+    if (seeked) {
+      mBuffered = 0;
+      mBufferFull = false;
+      mTimeouts = 0;
+      mJustSeeked = true;
+      if (mSharedStats)
+        gStats.bufferReset();
+    }
+    mSeeking = mSeekPending;
+    SDL_UnlockMutex(mLock);
+
+    if (seeked)
+      postFrame();
+    return seeked;
+  }
+
+  // Called by the main loop when it presents the first frame after a seek
+  void seekPresented() {
+    SDL_LockMutex(mLock);
+    if (mSeekRequestUs != -1)
+      mSeekLatency.record(now_us() - mSeekRequestUs);
+    mSeekRequestUs = -1;
+    SDL_UnlockMutex(mLock);
+  }
+
+  // Called by the decode thread when it has no more to decode. Returns true
+  // if it should carry on because a seek was requested in the meantime.
+  bool finished(int r) {
+    SDL_LockMutex(mLock);
+    bool resume = mSeekPending && !mCompleted;
+    if (!resume) {
+      mResult = r;
+      mCompleted = true;
+      mThreadExited = true;
+      mSeeking = false;
+    }
+    SDL_UnlockMutex(mLock);
+    if (!resume)
+      postFrame();
+    return resume;
+  }
+
+
+  void setCompleted(bool c) {
+    mCompleted = c;
+  }
+
+  // The last value returned by oggplay_step_decoding() before the decode
+  // thread exited. Negative values other than E_OGGPLAY_TIMEOUT are errors.
+  int result() {
+    return mResult;
+  }
+
+  void setResult(int r) {
+    mResult = r;
+  }
+
+  // Decode scheduling. The decode thread tells apart the three outcomes of
+  // oggplay_step_decoding(). On progress it carries on. When the buffer is
+  // full it parks until the main loop releases a buffer. When no data is
+  // available yet, e.g. from a slow network reader, it retries a few times
+  // and then backs off exponentially. A buffer release cuts the back off
+  // short.
+
+  // Number of buffer slots the decoder may fill, as passed to
+  // oggplay_use_buffer().
+  void setBufferDepth(int depth) {
+    SDL_LockMutex(mLock);
+    mDepth = depth;
+    SDL_UnlockMutex(mLock);
+  }
+
+  // Let 'sizer' adjust the depth as frames are decoded. It must outlive the
+  // decode thread.
+  void setBufferSizer(BufferSizer* sizer) {
+    SDL_LockMutex(mLock);
+    mSizer = sizer;
+    mDepth = sizer->depth();
+    mCapacity = sizer->maxDepth();
+    SDL_UnlockMutex(mLock);
+    if (mSharedStats)
+      gStats.setBufferCapacity(mCapacity);
+  }
+
+  // Whether buffer occupancy is also kept in gStats, which only makes sense
+  // for one decoder at a time. --batch runs several at once and turns it
+  // off. Call before setBufferSizer().
+  void shareStats(bool share) {
+    mSharedStats = share;
+  }
+
+  // Whether every liboggplay buffer slot holds a frame, so that
+  // oggplay_step_decoding() will wait for the main loop to release one.
+  bool bufferFull() {
+    SDL_LockMutex(mLock);
+    bool full = mCapacity > 0 && mBuffered >= mCapacity;
+    SDL_UnlockMutex(mLock);
+    return full;
+  }
+
+  // Called by the decode thread when oggplay_step_decoding() has put a frame
+  // in the buffer, 'us' after it started work on it. 'full' is true if it
+  // reported that the buffer is now full.
+  void frameBuffered(bool full, int64_t us) {
+    if (mSharedStats)
+      gStats.bufferFilled();
+    SDL_LockMutex(mLock);
+    ++mBuffered;
+    mPeakBuffered = std::max(mPeakBuffered, mBuffered);
+    mBufferFull = mBufferFull || full;
+    mTimeouts = 0;
+    if (mSizer)
+      mDepth = mSizer->frameDecoded(us);
+    SDL_UnlockMutex(mLock);
+    postFrame();
+  }
+
+  void reportSeeks() const {
+    if (mSeekRequests > 0) {
+      cout << "Seeks: " << mSeekRequests << " requested, " << mSeeksCoalesced
+           << " replaced by a later request before starting" << endl;
+    }
+    if (mSeekLatency.count() > 0)
+      cout << "Seek request to first frame: " << mSeekLatency.toString() << endl;
+    if (mIndexedSeeks.count() > 0)
+      cout << "Seeks using the keyframe index: " << mIndexedSeeks.toString() << endl;
+    if (mBisectSeeks.count() > 0)
+      cout << "Seeks bisecting the file: " << mBisectSeeks.toString() << endl;
+  }
+
+  // The most frames that have been in the buffer at once
+  int peakBuffered() {
+    SDL_LockMutex(mLock);
+    int peak = mPeakBuffered;
+    SDL_UnlockMutex(mLock);
+    return peak;
+  }
+
+  // Called by the main loop after each oggplay_buffer_release().
+  void bufferReleased() {
+    SDL_LockMutex(mLock);
+    spaceReleased();
+    SDL_UnlockMutex(mLock);
+  }
+
+  // Called by the decode thread before each step. Parks while the buffer is
+  // full. The wait is bounded so that if our count ever disagrees with
+  // liboggplay's we fall back to letting oggplay_step_decoding() block.
+  void waitForSpace() {
+    SDL_LockMutex(mLock);
+    if (!mCompleted && !mSeekPending && (mBufferFull || (mDepth > 0 && mBuffered >= mDepth))) {
+      gStats.count(Stats::DECODE_PARKS);
+      StageTimer timer(Stats::DECODE_PARKED);
+      SDL_CondWaitTimeout(mSpaceAvailable, mLock, 250);
+    }
+    SDL_UnlockMutex(mLock);
+  }
+
+  // Called by the decode thread when oggplay_step_decoding() timed out with
+  // no data.
+  void backOff() {
+    SDL_LockMutex(mLock);
+    ++mTimeouts;
+    if (mTimeouts <= 4) {
+      // Data is often only just late, so retry straight away at first
+      gStats.count(Stats::DECODE_SPINS);
+    }
+    else if (!mCompleted && !mSeekPending) {
+      Uint32 ms = 1 << std::min(mTimeouts - 5, 5);
+      gStats.count(Stats::DECODE_BACKOFFS);
+      StageTimer timer(Stats::DECODE_BACKOFF);
+      SDL_CondWaitTimeout(mSpaceAvailable, mLock, ms);
+    }
+    SDL_UnlockMutex(mLock);
+  }
+
+  // The main loop waits for the decode thread rather than polling the
+  // buffer. The decode thread calls postFrame() each time it puts a frame in
+  // the buffer, and when it exits. That wakes a waitForFrame() and, if the
+  // main loop is blocked in SDL_WaitEvent, posts an event to wake it.
+  void postFrame() {
+    SDL_LockMutex(mLock);
+    ++mFramesPosted;
+    bool wake_events = mEventWaiting;
+    mEventWaiting = false;
+    SDL_CondSignal(mFramePosted);
+    SDL_UnlockMutex(mLock);
+
+    if (wake_events) {
+      SDL_Event event;
+      event.type = SDL_USEREVENT;
+      event.user.code = FRAME_DECODED_EVENT;
+      event.user.data1 = 0;
+      event.user.data2 = 0;
+      SDL_PushEvent(&event);
+    }
+  }
+
+  // Number of postFrame() calls so far. Read this before trying to retrieve a
+  // buffer and pass it to the wait functions so a frame posted in between
+  // isn't missed.
+  unsigned long framesPosted() {
+    SDL_LockMutex(mLock);
+    unsigned long n = mFramesPosted;
+    SDL_UnlockMutex(mLock);
+    return n;
+  }
+
+  // Blocks until a frame is posted after 'seen', or for at most 'timeoutMs'.
+  void waitForFrame(unsigned long seen, Uint32 timeoutMs) {
+    SDL_LockMutex(mLock);
+    if (mFramesPosted == seen)
+      SDL_CondWaitTimeout(mFramePosted, mLock, timeoutMs);
+    SDL_UnlockMutex(mLock);
+  }
+
+  // Call before blocking in SDL_WaitEvent. Returns false if a frame has been
+  // posted after 'seen', in which case don't wait. Otherwise the next
+  // postFrame() will push an event.
+  bool beginEventWait(unsigned long seen) {
+    SDL_LockMutex(mLock);
+    bool wait = mFramesPosted == seen;
+    mEventWaiting = wait;
+    SDL_UnlockMutex(mLock);
+    return wait;
+  }
+
+  void endEventWait() {
+    SDL_LockMutex(mLock);
+    mEventWaiting = false;
+    SDL_UnlockMutex(mLock);
+  }
+
+  bool justSeeked() {
+    SDL_LockMutex(mLock);
+    bool seeked = mJustSeeked;
+    mJustSeeked = false;
+    SDL_UnlockMutex(mLock);
+    return seeked;
+  }
+
+private:
+  // Accounts for a released buffer. Called with mLock held.
+  void spaceReleased() {
+    if (mSharedStats)
+      gStats.bufferEmptied();
+    if (mBuffered > 0)
+      --mBuffered;
+    mBufferFull = false;
+    SDL_CondSignal(mSpaceAvailable);
+  }
+
+  void runSeek(long target) {
+    int64_t seek_start = now_us();
+    if (seek_player(mPlayer.get(), mIndex, mIndexTrack, target))
+      mIndexedSeeks.record(now_us() - seek_start);
+    else
+      mBisectSeeks.record(now_us() - seek_start);
+  }
+
+  SDL_Thread* mThread;
+  shared_ptr<OggPlay> mPlayer;
+  bool mCompleted;
+  bool mJustSeeked;
+  int mResult;
+
+  SDL_mutex* mLock;
+  SDL_cond* mFramePosted;
+  unsigned long mFramesPosted;
+  bool mEventWaiting;
+
+  SDL_cond* mSpaceAvailable;
+  int mDepth;
+  int mBuffered;
+  bool mBufferFull;
+  // Slots given to oggplay_use_buffer()
+  int mCapacity;
+  bool mSharedStats;
+  int mTimeouts;
+  int mPeakBuffered;
+  BufferSizer* mSizer;
+
+  KeyframeIndex* mIndex;
+  int mIndexTrack;
+  Histogram mIndexedSeeks;
+  Histogram mBisectSeeks;
+
+  // Seek requests, protected by mLock
+  bool mThreadExited;
+  bool mSeeking;
+  // True while the decode thread is inside runSeek(). mSeekDone is
+  // signalled when it comes out.
+  bool mSeekRunning;
+  SDL_cond* mSeekDone;
+  bool mSeekPending;
+  long mSeekTarget;
+  int64_t mSeekRequestUs;
+  long mSeekRequests;
+  long mSeeksCoalesced;
+  Histogram mSeekLatency;
+};
+
+// Decoding thread. Running the decode loop in a seperate thread avoids the
+// issue where some frames take longer to decode than the time for a frame
+// to be displayed (HD video for example).
+int decode_thread(void* p) {
+  Decoder* d = (Decoder*)p;
+  OggPlay* player = d->getPlayer();
+
+  // E_OGGPLAY_CONTINUE       = One frame decoded and put in buffer list
+  // E_OGGPLAY_USER_INTERRUPT = One frame decoded, buffer list is now full
+  // E_OGGPLAY_TIMEOUT        = No frames decoded, timed out
+  int r = E_OGGPLAY_TIMEOUT;
+
+  // When work on the next frame started, not counting time parked with the
+  // buffer full. Timeouts and back off waiting for data are included.
+  int64_t frame_start = -1;
+  do {
+    r = E_OGGPLAY_TIMEOUT;
+    while (!d->isCompleted() &&
+           (r == E_OGGPLAY_TIMEOUT ||
+           r == E_OGGPLAY_USER_INTERRUPT ||
+           r == E_OGGPLAY_CONTINUE)) {
+      d->waitForSpace();
+      if (d->seekIfRequested()) {
+        frame_start = -1;
+        continue;
+      }
+      if (d->isCompleted())
+        break;
+      if (frame_start == -1)
+        frame_start = now_us();
+
+      {
+        bool stalled = Stats::enabled && d->bufferFull();
+        StageTimer timer(stalled ? Stats::DECODE_STALL : Stats::DECODE_STEP, &gBenchmark.decode);
+        r = oggplay_step_decoding(player);
+      }
+      gStats.count(Stats::DECODE_STEPS);
+      if (r == E_OGGPLAY_CONTINUE || r == E_OGGPLAY_USER_INTERRUPT) {
+        gStats.count(Stats::DECODE_FRAMES);
+        int64_t now = now_us();
+        d->frameBuffered(r == E_OGGPLAY_USER_INTERRUPT, now - frame_start);
+        frame_start = -1;
+      }
+      else if (r == E_OGGPLAY_TIMEOUT) {
+        gStats.count(Stats::DECODE_TIMEOUTS);
+        d->backOff();
+      }
+    }
+  } while (d->finished(r));
+  return 0;
+}
+
+// A small RGB picture of the video at one point in media time, shown above
+// the seek bar when the mouse hovers over that point.
+struct Thumbnail {
+  Thumbnail(int width, int height)
+    : width(width),
+      height(height),
+      pixels(new unsigned char[width * height * 4])
+  {
+  }
+
+  int width;
+  int height;
+  scoped_array<unsigned char> pixels;
+};
+
+// Bounded cache of seek bar thumbnails, one per slot of media time, filled
+// in the background by a Thumbnailer. The slots divide the media into at
+// most 'capacity' parts. Hovering over a slot that has no thumbnail yet
+// makes it the next to be made. When full the least recently shown
+// thumbnail is evicted, but only to make room for one that was hovered
+// over; the background sweep stops instead.
+class ThumbnailCache {
+public:
+  ThumbnailCache(size_t capacity)
+    : mLock(SDL_CreateMutex()),
+      mWanted(SDL_CreateCond()),
+      mCapacity(capacity),
+      mIntervalMs(0),
+      mDurationMs(-1),
+      mSweepMs(0),
+      mRequestMs(-1),
+      mLastFoundMs(-1),
+      mClosed(false),
+      mHits(0),
+      mMisses(0),
+      mEvictions(0),
+      mMade(0),
+      mMakeUs(0)
+  {
+    assert(capacity > 0);
+  }
+
+  ~ThumbnailCache() {
+    SDL_DestroyCond(mWanted);
+    SDL_DestroyMutex(mLock);
+  }
+
+  // Called by the Thumbnailer once it knows the duration of the media, or
+  // with -1 if it can't be found. Slots are at least two seconds apart.
+  void setDuration(int64_t durationMs) {
+    SDL_LockMutex(mLock);
+    mDurationMs = durationMs;
+    if (durationMs > 0)
+      mIntervalMs = max(int64_t(2000), durationMs / int64_t(mCapacity));
+    else
+      mIntervalMs = 10000;
+    SDL_CondSignal(mWanted);
+    SDL_UnlockMutex(mLock);
+  }
+
+  // Returns the thumbnail for media time 'ms', or a null pointer if it
+  // hasn't been made yet. Called from the main thread as the seek bar is
+  // drawn.
+  shared_ptr<Thumbnail> find(int64_t ms) {
+    shared_ptr<Thumbnail> result;
+    SDL_LockMutex(mLock);
+    if (mIntervalMs > 0) {
+      int64_t slot = ms - ms % mIntervalMs;
+      Slots::iterator it = mSlots.find(slot);
+      if (it != mSlots.end()) {
+        mRecent.splice(mRecent.begin(), mRecent, it->second.recent);
+        result = it->second.thumbnail;
+        if (slot != mLastFoundMs)
+          ++mHits;
+        mLastFoundMs = slot;
+      }
+      else if (slot != mRequestMs && !mClosed) {
+        ++mMisses;
+        mRequestMs = slot;
+        mLastFoundMs = -1;
+        SDL_CondSignal(mWanted);
+      }
+    }
+    SDL_UnlockMutex(mLock);
+    return result;
+  }
+
+  // Waits for a slot to make a thumbnail for: the last one hovered over if
+  // any, else the next in the sweep. Sets 'requested' if it was hovered
+  // over. Returns false when the cache is closed.
+  bool next(int64_t& slotMs, bool& requested) {
+    SDL_LockMutex(mLock);
+    while (!mClosed) {
+      if (mRequestMs != -1) {
+        slotMs = mRequestMs;
+        mRequestMs = -1;
+        if (mSlots.count(slotMs))
+          continue;
+        requested = true;
+        break;
+      }
+      if (mIntervalMs > 0 && mSlots.size() < mCapacity &&
+          (mDurationMs < 0 || mSweepMs < mDurationMs)) {
+        slotMs = mSweepMs;
+        mSweepMs += mIntervalMs;
+        if (mSlots.count(slotMs))
+          continue;
+        requested = false;
+        break;
+      }
+      SDL_CondWait(mWanted, mLock);
+    }
+    bool open = !mClosed;
+    SDL_UnlockMutex(mLock);
+    return open;
+  }
+
+  // Adds the thumbnail made for 'slotMs', which took 'us' to make
+  void add(int64_t slotMs, shared_ptr<Thumbnail> thumbnail, bool requested, int64_t us) {
+    SDL_LockMutex(mLock);
+    ++mMade;
+    mMakeUs += us;
+    if (!mSlots.count(slotMs) && (requested || mSlots.size() < mCapacity)) {
+      if (mSlots.size() == mCapacity) {
+        mSlots.erase(mRecent.back());
+        mRecent.pop_back();
+        ++mEvictions;
+      }
+      mRecent.push_front(slotMs);
+      Slot& slot = mSlots[slotMs];
+      slot.thumbnail = thumbnail;
+      slot.recent = mRecent.begin();
+    }
+    SDL_UnlockMutex(mLock);
+  }
+
+  // The media ended before 'slotMs'. Stops the sweep there.
+  void ended(int64_t slotMs) {
+    SDL_LockMutex(mLock);
+    if (mDurationMs < 0 || slotMs < mDurationMs)
+      mDurationMs = slotMs;
+    SDL_UnlockMutex(mLock);
+  }
+
+  bool closed() {
+    SDL_LockMutex(mLock);
+    bool closed = mClosed;
+    SDL_UnlockMutex(mLock);
+    return closed;
+  }
+
+  // Wakes the Thumbnailer so that it exits
+  void close() {
+    SDL_LockMutex(mLock);
+    mClosed = true;
+    SDL_CondBroadcast(mWanted);
+    SDL_UnlockMutex(mLock);
+  }
+
+  void report() {
+    SDL_LockMutex(mLock);
+    size_t bytes = 0;
+    for (Slots::iterator it = mSlots.begin(); it != mSlots.end(); ++it)
+      bytes += it->second.thumbnail->width * it->second.thumbnail->height * 4;
+    cout << "Thumbnails: " << mMade << " made";
+    if (mMade > 0)
+      cout << " in " << mMakeUs / mMade / 1000 << " ms each";
+    cout << ", " << mSlots.size() << "/" << mCapacity << " cached (" << bytes / 1024
+         << " KB), " << mHits << " hits, " << mMisses << " misses, "
+         << mEvictions << " evictions" << endl;
+    SDL_UnlockMutex(mLock);
+  }
+
+private:
+  // Slots, most recently shown first
+  typedef list<int64_t> Recent;
+
+  struct Slot {
+    shared_ptr<Thumbnail> thumbnail;
+    Recent::iterator recent;
+  };
+  typedef map<int64_t, Slot> Slots;
+
+  SDL_mutex* mLock;
+  SDL_cond* mWanted;
+  size_t mCapacity;
+
+  // Media time between slots, 0 until the duration is known
+  int64_t mIntervalMs;
+  int64_t mDurationMs;
+
+  // Next slot in the background sweep
+  int64_t mSweepMs;
+
+  // Slot last hovered over without a thumbnail, or -1
+  int64_t mRequestMs;
+
+  // Slot last found, so that hovering over one slot is one hit
+  int64_t mLastFoundMs;
+  bool mClosed;
+
+  Recent mRecent;
+  Slots mSlots;
+
+  long mHits;
+  long mMisses;
+  long mEvictions;
+  long mMade;
+  int64_t mMakeUs;
+};
+
+// Displays onscreen a bar which indicates how far through the media playback
+// has reached. You can click on the seek bar to seek. Seek bar is visible when
+// the mouse hovers over it, or for a number of seconds after last mouse motion.
+class SeekBar {
 public:
   SeekBar(shared_ptr<OggPlay> player,
           Decoder& decoder,
@@ -332,6 +2183,8 @@ public:
       mStartTimeMs(0),
       mEndTimeMs(-1),
       mCurrentTimeMs(0),
+      mDurationScanUs(0),
+      mThumbnails(0),
       mVisibleDuration(visibleDuration),
       mHeight(height),
       mPadding(padding),
@@ -339,486 +2192,4414 @@ public:
   {
     updateHideTime();
   }
-  
-  // Sets the time of the most recently played frame.
-  void setCurrentTime(int64_t timeMs) {
-    mCurrentTimeMs = timeMs;
+  
+  // Sets the time of the most recently played frame.
+  void setCurrentTime(int64_t timeMs) {
+    mCurrentTimeMs = timeMs;
+  }
+  
+  void setStartTime(int64_t timeMs) {
+    mStartTimeMs = timeMs;
+  }
+
+  // Sets the duration of the media if it's already known, e.g. from the
+  // sidecar cache, so that it doesn't have to be found by a scan.
+  void setEndTime(int64_t timeMs) {
+    mEndTimeMs = timeMs;
+  }
+
+  // The duration of the media, or -1 if it hasn't been needed yet
+  int64_t endTime() const {
+    return mEndTimeMs;
+  }
+
+  // How long finding the duration took
+  int64_t durationScanUs() const {
+    return mDurationScanUs;
+  }
+
+  // Show thumbnails from 'thumbnails' when hovering over the bar
+  void setThumbnails(ThumbnailCache* thumbnails) {
+    mThumbnails = thumbnails;
+  }
+  
+  void draw(shared_ptr<SDL_Surface>& screen) {
+    if (!isVisible(screen) || !screen) {
+      return;
+    }
+
+    StageTimer timer(Stats::SEEKBAR_DRAW);
+    gStats.count(Stats::SEEKBAR_DRAWS);
+    
+    SDL_Rect border = getBorderRect(screen);
+    unsigned white = SDL_MapRGB(screen->format, 255, 255, 255);
+    int err = SDL_FillRect(screen.get(), &border, white);
+    assert(err == 0);
+    
+    SDL_Rect background = getBackgroundRect(screen);
+    unsigned black = SDL_MapRGB(screen->format, 0, 0, 0);
+    err = SDL_FillRect(screen.get(), &background, black);
+    assert(err == 0);
+    
+    SDL_Rect progress = getProgressRect(screen);
+    unsigned gray = SDL_MapRGB(screen->format, 0xd6, 0xd6, 0xd6);
+    err = SDL_FillRect(screen.get(), &progress, gray);
+    
+    assert(err == 0);
+
+    if (mThumbnails)
+      drawThumbnail(screen, background);
+  }
+  
+  // Returns true if handles/consumes the event, otherwise false.
+  bool handleEvent(shared_ptr<SDL_Surface> screen, SDL_Event const& event) {
+    if (event.type == SDL_MOUSEMOTION) {
+      updateHideTime();
+      return true;
+    } else if (event.type == SDL_MOUSEBUTTONDOWN &&
+               event.button.button == SDL_BUTTON_LEFT) {
+      int x = event.button.x;
+      int y = event.button.y;
+      SDL_Rect background = getBackgroundRect(screen);
+      SDL_Rect progress = getProgressRect(screen);
+      if (isInside(x, y, background)) {
+        mDecoder.requestSeek(timeAt(x, background, progress));
+        return true;
+      }
+      return false;
+    }
+    return false;
+  }  
+  
+private:
+
+  SDL_Rect getBorderRect(shared_ptr<SDL_Surface> screen) {
+    SDL_Rect border;
+    border.x = mPadding;
+    border.y = screen->h - mPadding - mHeight;
+    border.w = screen->w - mPadding * 2;
+    border.h = mHeight;
+    return border;
+  }
+
+  SDL_Rect getBackgroundRect(shared_ptr<SDL_Surface> screen) {
+    SDL_Rect background;
+    background.x = mPadding + mBorder;
+    background.y = screen->h - mPadding - mHeight + mBorder;
+    background.w = screen->w - 2 * mPadding - 2 * mBorder;
+    background.h = mHeight - 2 * mBorder;
+    return background;
+  }
+
+  SDL_Rect getProgressRect(shared_ptr<SDL_Surface> screen) {
+    if (mEndTimeMs == -1) {
+      // Due to a bug in liboggplay, we can't call this before the frames
+      // start coming in, else we'll sometimes deadlock on some files.
+      int64_t start = now_us();
+      mEndTimeMs = oggplay_get_duration(mPlayer.get());
+      mDurationScanUs = now_us() - start;
+    }
+    double duration = mEndTimeMs - mStartTimeMs;
+    double position = mCurrentTimeMs - mStartTimeMs;
+    SDL_Rect background = getBackgroundRect(screen);
+    double maxWidth = background.w - 2 * mBorder;
+    SDL_Rect progress;
+    progress.x = background.x + mBorder;
+    progress.y = background.y + mBorder;
+    progress.h = background.h - 2 * mBorder;
+    progress.w = max(1, (int)(maxWidth * position / duration));
+    return progress;
+  }
+
+  // Media time at 'x' pixels across the bar
+  int64_t timeAt(int x, const SDL_Rect& background, const SDL_Rect& progress) {
+    double progressWidth = background.w - 2 * mBorder;
+    double proportion = (x - progress.x) / progressWidth;
+    double duration = mEndTimeMs - mStartTimeMs;
+    double seekTime = duration * proportion;
+    return mStartTimeMs + (int64_t)seekTime;
+  }
+
+  // Draws the thumbnail for the time under the mouse pointer above the bar,
+  // if it has been made.
+  void drawThumbnail(shared_ptr<SDL_Surface>& screen, const SDL_Rect& background) {
+    int x=0, y=0;
+    SDL_GetMouseState(&x, &y);
+    if (!isInside(x, y, background) || mEndTimeMs == -1)
+      return;
+
+    SDL_Rect progress = getProgressRect(screen);
+    shared_ptr<Thumbnail> thumbnail(mThumbnails->find(timeAt(x, background, progress)));
+    if (!thumbnail)
+      return;
+
+    int w = thumbnail->width, h = thumbnail->height;
+    shared_ptr<SDL_Surface> surface(SDL_CreateRGBSurfaceFrom(thumbnail->pixels.get(),
+                                                             w, h, 32, 4 * w,
+                                                             0, 0, 0, 0),
+                                    SDL_FreeSurface);
+    assert(surface);
+
+    SDL_Rect rect;
+    rect.x = max(0, min(x - w / 2, screen->w - w));
+    rect.y = max(0, background.y - mBorder - mPadding - h);
+    rect.w = w;
+    rect.h = h;
+    int err = SDL_BlitSurface(surface.get(), NULL, screen.get(), &rect);
+    assert(err == 0);
+  }
+
+  bool isInside(int x, int y, const SDL_Rect& rect) {
+    return x > rect.x &&
+           x < rect.x + rect.w &&
+           y > rect.y &&
+           y < rect.y + rect.h;
+  }
+
+  bool isVisible(shared_ptr<SDL_Surface> screen) {
+    int x=0, y=0;
+    SDL_GetMouseState(&x, &y);
+    SDL_Rect background = getBackgroundRect(screen);
+    return second_clock::local_time() < mHideTime ||
+           isInside(x, y, background);
+  }
+
+  void updateHideTime() {
+    mHideTime = second_clock::local_time() + mVisibleDuration;
+  }
+
+  shared_ptr<OggPlay> mPlayer;
+  Decoder& mDecoder;
+
+  int64_t mStartTimeMs;
+  int64_t mEndTimeMs;
+  int64_t mCurrentTimeMs;
+  int64_t mDurationScanUs;
+
+  // Source of thumbnails to show on hover, or null for none
+  ThumbnailCache* mThumbnails;
+
+  // Height of the seek bar, in pixels, including borders, background,
+  // and progress bar.
+  int mHeight;
+  
+  // Number of pixels between bottom and sides of screen and the seek bar.
+  int mPadding;
+  
+  // Thickness of borders in pixels.
+  int mBorder;
+  
+  ptime mHideTime;
+  time_duration mVisibleDuration;
+  
+};
+
+// Conversion of liboggplay's float samples to the S16 format the sound device
+// is opened with. Every implementation must give exactly the same results as
+// float_to_s16_scalar: round half up, then saturate to the S16 range. NaN
+// becomes silence.
+typedef void (*FloatToS16)(const float* source, short* dest, int count);
+
+void float_to_s16_scalar(const float* source, short* dest, int count) {
+  for (int i=0; i < count; ++i) {
+    float scaled = floorf(0.5 + 32768 * source[i]);
+    if (source[i] != source[i])
+      dest[i] = 0;
+    else if (source[i] < 0.0)
+      dest[i] = scaled < -32768.0 ? -32768 : static_cast<short>(scaled);
+    else
+      dest[i] = scaled > 32767.0 ? 32767 : static_cast<short>(scaled);
+  }
+}
+
+#ifdef OGGPLAYER_X86
+// SSE2 has no floor instruction. Truncate towards zero and subtract one from
+// the lanes where that rounded up. Clamping to the S16 range happens before
+// the integer conversion so out of range samples can't overflow it.
+__attribute__((target("sse2")))
+void float_to_s16_sse2(const float* source, short* dest, int count) {
+  const __m128 scale = _mm_set1_ps(32768.0f);
+  const __m128 half = _mm_set1_ps(0.5f);
+  const __m128 lo = _mm_set1_ps(-32768.0f);
+  const __m128 hi = _mm_set1_ps(32767.0f);
+  int i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128 a = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(source + i), scale), half);
+    __m128 b = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(source + i + 4), scale), half);
+    // Zero NaN lanes, which min and max would otherwise turn into 32767
+    a = _mm_and_ps(a, _mm_cmpord_ps(a, a));
+    b = _mm_and_ps(b, _mm_cmpord_ps(b, b));
+    a = _mm_max_ps(_mm_min_ps(a, hi), lo);
+    b = _mm_max_ps(_mm_min_ps(b, hi), lo);
+    __m128i ia = _mm_cvttps_epi32(a);
+    __m128i ib = _mm_cvttps_epi32(b);
+    ia = _mm_add_epi32(ia, _mm_castps_si128(_mm_cmpgt_ps(_mm_cvtepi32_ps(ia), a)));
+    ib = _mm_add_epi32(ib, _mm_castps_si128(_mm_cmpgt_ps(_mm_cvtepi32_ps(ib), b)));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + i), _mm_packs_epi32(ia, ib));
+  }
+  float_to_s16_scalar(source + i, dest + i, count - i);
+}
+
+__attribute__((target("avx2")))
+void float_to_s16_avx2(const float* source, short* dest, int count) {
+  const __m256 scale = _mm256_set1_ps(32768.0f);
+  const __m256 half = _mm256_set1_ps(0.5f);
+  const __m256 lo = _mm256_set1_ps(-32768.0f);
+  const __m256 hi = _mm256_set1_ps(32767.0f);
+  int i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m256 a = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(source + i), scale), half);
+    __m256 b = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(source + i + 8), scale), half);
+    a = _mm256_and_ps(a, _mm256_cmp_ps(a, a, _CMP_ORD_Q));
+    b = _mm256_and_ps(b, _mm256_cmp_ps(b, b, _CMP_ORD_Q));
+    a = _mm256_max_ps(_mm256_min_ps(_mm256_floor_ps(a), hi), lo);
+    b = _mm256_max_ps(_mm256_min_ps(_mm256_floor_ps(b), hi), lo);
+    // packs works within 128 bit lanes, so put the quadwords back in order
+    __m256i packed = _mm256_packs_epi32(_mm256_cvttps_epi32(a), _mm256_cvttps_epi32(b));
+    packed = _mm256_permute4x64_epi64(packed, 0xd8);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + i), packed);
+  }
+  float_to_s16_scalar(source + i, dest + i, count - i);
+}
+#endif
+
+// Instruction sets that the conversion kernels can be specialised for.
+enum SimdLevel {
+  SIMD_SCALAR,
+  SIMD_SSE2,
+  SIMD_AVX2
+};
+
+const char* simd_level_name(SimdLevel level) {
+  switch (level) {
+    case SIMD_SSE2: return "sse2";
+    case SIMD_AVX2: return "avx2";
+    default:        return "scalar";
+  }
+}
+
+// Returns the best instruction set the running CPU supports.
+SimdLevel detect_simd_level() {
+#ifdef OGGPLAYER_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return SIMD_AVX2;
+  if (__builtin_cpu_supports("sse2"))
+    return SIMD_SSE2;
+#endif
+  return SIMD_SCALAR;
+}
+
+// Parses a --*-converter= style name. Returns false if the name is unknown or
+// the CPU can't run that implementation.
+bool parse_simd_level(const char* name, SimdLevel& level) {
+  SimdLevel best = detect_simd_level();
+  if (strcmp(name, "auto") == 0)
+    level = best;
+  else if (strcmp(name, "scalar") == 0)
+    level = SIMD_SCALAR;
+  else if (strcmp(name, "sse2") == 0 && best >= SIMD_SSE2)
+    level = SIMD_SSE2;
+  else if (strcmp(name, "avx2") == 0 && best >= SIMD_AVX2)
+    level = SIMD_AVX2;
+  else
+    return false;
+  return true;
+}
+
+// Picks the float to S16 routine once, at startup, based on what the CPU
+// supports.
+class AudioConverter {
+  public:
+    AudioConverter() {
+      select(detect_simd_level());
+    }
+
+    void select(SimdLevel level) {
+      mLevel = level;
+      mConvert = float_to_s16_scalar;
+#ifdef OGGPLAYER_X86
+      if (level == SIMD_AVX2)
+        mConvert = float_to_s16_avx2;
+      else if (level == SIMD_SSE2)
+        mConvert = float_to_s16_sse2;
+#endif
+    }
+
+    void convert(const float* source, short* dest, int count) const {
+      mConvert(source, dest, count);
+    }
+
+    const char* name() const {
+      return simd_level_name(mLevel);
+    }
+
+  private:
+    SimdLevel mLevel;
+    FloatToS16 mConvert;
+};
+
+AudioConverter gAudioConverter;
+
+// Compares each float to S16 routine the CPU can run with
+// float_to_s16_scalar on full scale, rounding ties, NaN, infinities, out of
+// range and random samples. Every run length from 1 to 40, and two offsets,
+// are converted so that the vector loops and their scalar tails are both
+// covered. Returns the number of routines that disagreed.
+int test_audio_converters() {
+  vector<float> samples;
+  const float specials[] = {
+    0.0f, -0.0f, 1.0f, -1.0f, 0.5f, -0.5f, 32767.0f / 32768, -32768.0f / 32768,
+    32767.5f / 32768, -32768.5f / 32768, 1.5f, -1.5f, 1e30f, -1e30f,
+    numeric_limits<float>::infinity(), -numeric_limits<float>::infinity(),
+    numeric_limits<float>::quiet_NaN(), -numeric_limits<float>::quiet_NaN(),
+    numeric_limits<float>::denorm_min(), -numeric_limits<float>::denorm_min()
+  };
+  samples.insert(samples.end(), specials, specials + sizeof(specials) / sizeof(specials[0]));
+  // Exact values and half LSB ties across the range
+  for (int k=-32770; k <= 32770; k += 7) {
+    samples.push_back(k / 32768.0f);
+    samples.push_back((k + 0.5f) / 32768.0f);
+  }
+  srand(1);
+  for (int i=0; i < 100000; ++i)
+    samples.push_back((rand() / float(RAND_MAX)) * 3.0f - 1.5f);
+
+  static const char* names[] = { "sse2", "avx2" };
+  int failures = 0;
+  for (size_t n=0; n < sizeof(names) / sizeof(names[0]); ++n) {
+    SimdLevel level;
+    if (!parse_simd_level(names[n], level)) {
+      cout << names[n] << ": not supported by this CPU, skipped" << endl;
+      continue;
+    }
+    AudioConverter converter;
+    converter.select(level);
+
+    long mismatches = 0;
+    size_t first = 0;
+    vector<short> expected(samples.size()), got(samples.size());
+    for (int offset=0; offset < 2; ++offset) {
+      for (size_t start=offset; start < samples.size(); ) {
+        int count = min<size_t>(1 + start % 40, samples.size() - start);
+        float_to_s16_scalar(&samples[start], &expected[start], count);
+        converter.convert(&samples[start], &got[start], count);
+        start += count;
+      }
+      for (size_t i=offset; i < samples.size(); ++i) {
+        if (got[i] != expected[i] && mismatches++ == 0)
+          first = i;
+      }
+    }
+    if (mismatches) {
+      cout << names[n] << ": " << mismatches << " mismatches, first for " << samples[first]
+           << ": " << got[first] << " instead of " << expected[first] << endl;
+      ++failures;
+    }
+    else {
+      cout << names[n] << ": matches scalar on " << samples.size() << " samples" << endl;
+    }
+  }
+  return failures;
+}
+
+// Colour matrices for converting video range (16-235) YUV to RGB.
+enum YUVMatrix {
+  YUV_BT601,
+  YUV_BT709
+};
+
+// Fixed point YUV to RGB coefficients. Each is the usual 8.8 fixed point
+// value multiplied by 8, so that for a sample 's' centred on zero,
+// (s << 7) * k >> 16 gives the contribution with two extra bits of precision.
+// That is exactly what SSE2's pmulhw computes, so the scalar and vector
+// kernels produce identical output.
+struct YUVCoefficients {
+  int y, rv, gu, gv, bu;
+};
+
+YUVCoefficients yuv_coefficients(YUVMatrix matrix) {
+  YUVCoefficients bt601 = { 298 * 8, 409 * 8, 100 * 8, 208 * 8, 516 * 8 };
+  YUVCoefficients bt709 = { 298 * 8, 459 * 8,  55 * 8, 136 * 8, 541 * 8 };
+  return matrix == YUV_BT709 ? bt709 : bt601;
+}
+
+inline int yuv_term(int sample, int k) {
+  return (sample * 128 * k) >> 16;
+}
+
+inline unsigned int clamp_byte(int v) {
+  return v < 0 ? 0 : (v > 255 ? 255 : v);
+}
+
+// Converts one row of pixels to 32 bit xRGB in native byte order, which is
+// the layout oggplay_yuv2bgra/oggplay_yuv2argb produce. 'xshift' is 1 when
+// each chroma sample covers two pixels horizontally, 0 for 4:4:4.
+void yuv_row_scalar(const unsigned char* y, const unsigned char* u, const unsigned char* v,
+                    unsigned int* dest, int width, int xshift, const YUVCoefficients& c) {
+  for (int x=0; x < width; ++x) {
+    int yt = yuv_term(y[x] - 16, c.y);
+    int cu = u[x >> xshift] - 128;
+    int cv = v[x >> xshift] - 128;
+    unsigned int r = clamp_byte((yt + yuv_term(cv, c.rv) + 2) >> 2);
+    unsigned int g = clamp_byte((yt - (yuv_term(cu, c.gu) + yuv_term(cv, c.gv)) + 2) >> 2);
+    unsigned int b = clamp_byte((yt + yuv_term(cu, c.bu) + 2) >> 2);
+    dest[x] = 0xff000000 | (r << 16) | (g << 8) | b;
+  }
+}
+
+// Row kernels for horizontally subsampled chroma (4:2:0 and 4:2:2).
+typedef void (*YUVRow)(const unsigned char* y, const unsigned char* u, const unsigned char* v,
+                       unsigned int* dest, int width, const YUVCoefficients& c);
+
+void yuv_row_subsampled_scalar(const unsigned char* y, const unsigned char* u, const unsigned char* v,
+                               unsigned int* dest, int width, const YUVCoefficients& c) {
+  yuv_row_scalar(y, u, v, dest, width, 1, c);
+}
+
+#ifdef OGGPLAYER_X86
+// 16 pixels per iteration. Chroma terms are computed once per sample and then
+// duplicated across the two pixels they cover.
+__attribute__((target("sse2")))
+void yuv_row_sse2(const unsigned char* y, const unsigned char* u, const unsigned char* v,
+                  unsigned int* dest, int width, const YUVCoefficients& c) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i alpha = _mm_set1_epi8(-1);
+  const __m128i y_offset = _mm_set1_epi16(16);
+  const __m128i uv_offset = _mm_set1_epi16(128);
+  const __m128i round = _mm_set1_epi16(2);
+  const __m128i ky = _mm_set1_epi16(c.y);
+  const __m128i krv = _mm_set1_epi16(c.rv);
+  const __m128i kgu = _mm_set1_epi16(c.gu);
+  const __m128i kgv = _mm_set1_epi16(c.gv);
+  const __m128i kbu = _mm_set1_epi16(c.bu);
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    __m128i yy = _mm_loadu_si128(reinterpret_cast<const __m128i*>(y + x));
+    __m128i uu = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(u + x / 2));
+    __m128i vv = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(v + x / 2));
+
+    __m128i ylo = _mm_slli_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(yy, zero), y_offset), 7);
+    __m128i yhi = _mm_slli_epi16(_mm_sub_epi16(_mm_unpackhi_epi8(yy, zero), y_offset), 7);
+    uu = _mm_slli_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(uu, zero), uv_offset), 7);
+    vv = _mm_slli_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(vv, zero), uv_offset), 7);
+    ylo = _mm_add_epi16(_mm_mulhi_epi16(ylo, ky), round);
+    yhi = _mm_add_epi16(_mm_mulhi_epi16(yhi, ky), round);
+
+    __m128i rc = _mm_mulhi_epi16(vv, krv);
+    __m128i gc = _mm_add_epi16(_mm_mulhi_epi16(uu, kgu), _mm_mulhi_epi16(vv, kgv));
+    __m128i bc = _mm_mulhi_epi16(uu, kbu);
+
+    __m128i r = _mm_packus_epi16(_mm_srai_epi16(_mm_add_epi16(ylo, _mm_unpacklo_epi16(rc, rc)), 2),
+                                 _mm_srai_epi16(_mm_add_epi16(yhi, _mm_unpackhi_epi16(rc, rc)), 2));
+    __m128i g = _mm_packus_epi16(_mm_srai_epi16(_mm_sub_epi16(ylo, _mm_unpacklo_epi16(gc, gc)), 2),
+                                 _mm_srai_epi16(_mm_sub_epi16(yhi, _mm_unpackhi_epi16(gc, gc)), 2));
+    __m128i b = _mm_packus_epi16(_mm_srai_epi16(_mm_add_epi16(ylo, _mm_unpacklo_epi16(bc, bc)), 2),
+                                 _mm_srai_epi16(_mm_add_epi16(yhi, _mm_unpackhi_epi16(bc, bc)), 2));
+
+    // Interleave into B, G, R, A byte order
+    __m128i bg_lo = _mm_unpacklo_epi8(b, g);
+    __m128i bg_hi = _mm_unpackhi_epi8(b, g);
+    __m128i ra_lo = _mm_unpacklo_epi8(r, alpha);
+    __m128i ra_hi = _mm_unpackhi_epi8(r, alpha);
+    __m128i* out = reinterpret_cast<__m128i*>(dest + x);
+    _mm_storeu_si128(out,     _mm_unpacklo_epi16(bg_lo, ra_lo));
+    _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(bg_lo, ra_lo));
+    _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(bg_hi, ra_hi));
+    _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(bg_hi, ra_hi));
+  }
+  yuv_row_scalar(y + x, u + x / 2, v + x / 2, dest + x, width - x, 1, c);
+}
+
+// Computes the terms for 16 pixels whose chroma samples have already been
+// duplicated and widened.
+__attribute__((target("avx2")))
+inline void yuv_terms_avx2(__m256i yy, __m256i uu, __m256i vv, const YUVCoefficients& c,
+                           __m256i& r, __m256i& g, __m256i& b) {
+  const __m256i round = _mm256_set1_epi16(2);
+  yy = _mm256_slli_epi16(_mm256_sub_epi16(yy, _mm256_set1_epi16(16)), 7);
+  uu = _mm256_slli_epi16(_mm256_sub_epi16(uu, _mm256_set1_epi16(128)), 7);
+  vv = _mm256_slli_epi16(_mm256_sub_epi16(vv, _mm256_set1_epi16(128)), 7);
+  yy = _mm256_add_epi16(_mm256_mulhi_epi16(yy, _mm256_set1_epi16(c.y)), round);
+  __m256i gc = _mm256_add_epi16(_mm256_mulhi_epi16(uu, _mm256_set1_epi16(c.gu)),
+                                _mm256_mulhi_epi16(vv, _mm256_set1_epi16(c.gv)));
+  r = _mm256_srai_epi16(_mm256_add_epi16(yy, _mm256_mulhi_epi16(vv, _mm256_set1_epi16(c.rv))), 2);
+  g = _mm256_srai_epi16(_mm256_sub_epi16(yy, gc), 2);
+  b = _mm256_srai_epi16(_mm256_add_epi16(yy, _mm256_mulhi_epi16(uu, _mm256_set1_epi16(c.bu))), 2);
+}
+
+// 32 pixels per iteration. The AVX2 pack and unpack instructions work within
+// 128 bit lanes, hence the permutes to restore pixel order.
+__attribute__((target("avx2")))
+void yuv_row_avx2(const unsigned char* y, const unsigned char* u, const unsigned char* v,
+                  unsigned int* dest, int width, const YUVCoefficients& c) {
+  const __m256i alpha = _mm256_set1_epi8(-1);
+  int x = 0;
+  for (; x + 32 <= width; x += 32) {
+    __m128i uu = _mm_loadu_si128(reinterpret_cast<const __m128i*>(u + x / 2));
+    __m128i vv = _mm_loadu_si128(reinterpret_cast<const __m128i*>(v + x / 2));
+    __m256i ra, ga, ba, rb, gb, bb;
+    yuv_terms_avx2(_mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(y + x))),
+                   _mm256_cvtepu8_epi16(_mm_unpacklo_epi8(uu, uu)),
+                   _mm256_cvtepu8_epi16(_mm_unpacklo_epi8(vv, vv)),
+                   c, ra, ga, ba);
+    yuv_terms_avx2(_mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(y + x + 16))),
+                   _mm256_cvtepu8_epi16(_mm_unpackhi_epi8(uu, uu)),
+                   _mm256_cvtepu8_epi16(_mm_unpackhi_epi8(vv, vv)),
+                   c, rb, gb, bb);
+    __m256i r = _mm256_permute4x64_epi64(_mm256_packus_epi16(ra, rb), 0xd8);
+    __m256i g = _mm256_permute4x64_epi64(_mm256_packus_epi16(ga, gb), 0xd8);
+    __m256i b = _mm256_permute4x64_epi64(_mm256_packus_epi16(ba, bb), 0xd8);
+
+    __m256i bg_lo = _mm256_unpacklo_epi8(b, g);
+    __m256i bg_hi = _mm256_unpackhi_epi8(b, g);
+    __m256i ra_lo = _mm256_unpacklo_epi8(r, alpha);
+    __m256i ra_hi = _mm256_unpackhi_epi8(r, alpha);
+    __m256i p0 = _mm256_unpacklo_epi16(bg_lo, ra_lo);
+    __m256i p1 = _mm256_unpackhi_epi16(bg_lo, ra_lo);
+    __m256i p2 = _mm256_unpacklo_epi16(bg_hi, ra_hi);
+    __m256i p3 = _mm256_unpackhi_epi16(bg_hi, ra_hi);
+    __m256i* out = reinterpret_cast<__m256i*>(dest + x);
+    _mm256_storeu_si256(out,     _mm256_permute2x128_si256(p0, p1, 0x20));
+    _mm256_storeu_si256(out + 1, _mm256_permute2x128_si256(p2, p3, 0x20));
+    _mm256_storeu_si256(out + 2, _mm256_permute2x128_si256(p0, p1, 0x31));
+    _mm256_storeu_si256(out + 3, _mm256_permute2x128_si256(p2, p3, 0x31));
+  }
+  yuv_row_sse2(y + x, u + x / 2, v + x / 2, dest + x, width - x, c);
+}
+#endif
+
+// Number of processors available to run worker threads on
+int processor_count() {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? n : 1;
+}
+
+// Persistent threads that share the parts of a job with the thread that
+// submits it, which returns once every part is done. Used to convert the
+// bands of a large frame in parallel.
+class WorkerPool {
+public:
+  // Work that can be done in independent parts
+  class Job {
+  public:
+    virtual ~Job() { }
+    virtual void run(int part) = 0;
+  };
+
+  WorkerPool()
+    : mLock(SDL_CreateMutex()),
+      mSubmit(SDL_CreateMutex()),
+      mStart(SDL_CreateCond()),
+      mDone(SDL_CreateCond()),
+      mJob(0),
+      mParts(0),
+      mNext(0),
+      mRemaining(0),
+      mStopping(false)
+  {
+  }
+
+  ~WorkerPool() {
+    stop();
+    SDL_DestroyCond(mDone);
+    SDL_DestroyCond(mStart);
+    SDL_DestroyMutex(mSubmit);
+    SDL_DestroyMutex(mLock);
+  }
+
+  // Starts 'threads' workers to help the submitting thread
+  void start(int threads) {
+    assert(mThreads.empty());
+    mStopping = false;
+    for (int i=0; i < threads; ++i) {
+      SDL_Thread* thread = SDL_CreateThread(worker_thread, this);
+      if (!thread)
+        break;
+      mThreads.push_back(thread);
+    }
+  }
+
+  void stop() {
+    SDL_LockMutex(mLock);
+    mStopping = true;
+    SDL_CondBroadcast(mStart);
+    SDL_UnlockMutex(mLock);
+    for (size_t i=0; i < mThreads.size(); ++i)
+      SDL_WaitThread(mThreads[i], NULL);
+    mThreads.clear();
+  }
+
+  // Threads that run a job's parts, including the submitting thread
+  int size() const {
+    return mThreads.size() + 1;
+  }
+
+  // Runs parts 0 to 'parts' - 1 of 'job', returning when they're all done.
+  // Jobs from different threads run one at a time.
+  void run(Job& job, int parts) {
+    if (mThreads.empty() || parts < 2) {
+      for (int i=0; i < parts; ++i)
+        job.run(i);
+      return;
+    }
+
+    SDL_LockMutex(mSubmit);
+    SDL_LockMutex(mLock);
+    mJob = &job;
+    mParts = parts;
+    mNext = 0;
+    mRemaining = parts;
+    SDL_CondBroadcast(mStart);
+    work(false);
+    while (mRemaining > 0)
+      SDL_CondWait(mDone, mLock);
+    mJob = 0;
+    SDL_UnlockMutex(mLock);
+    SDL_UnlockMutex(mSubmit);
+  }
+
+private:
+  static int worker_thread(void* data) {
+    WorkerPool* pool = static_cast<WorkerPool*>(data);
+    SDL_LockMutex(pool->mLock);
+    pool->work(true);
+    SDL_UnlockMutex(pool->mLock);
+    return 0;
+  }
+
+  // Runs parts of the current job until there are none left, then returns
+  // or, for a worker, waits for the next job. Called with the lock held.
+  void work(bool worker) {
+    while (!mStopping) {
+      if (mJob && mNext < mParts) {
+        int part = mNext++;
+        Job* job = mJob;
+        SDL_UnlockMutex(mLock);
+        job->run(part);
+        SDL_LockMutex(mLock);
+        if (--mRemaining == 0)
+          SDL_CondSignal(mDone);
+      }
+      else if (worker) {
+        SDL_CondWait(mStart, mLock);
+      }
+      else {
+        return;
+      }
+    }
+  }
+
+  SDL_mutex* mLock;
+  // Held while a job runs, so jobs don't overlap
+  SDL_mutex* mSubmit;
+  // Signalled when a job is submitted
+  SDL_cond* mStart;
+  // Signalled when the last part of a job is done
+  SDL_cond* mDone;
+  vector<SDL_Thread*> mThreads;
+
+  Job* mJob;
+  int mParts;
+  // Next part to run
+  int mNext;
+  // Parts not yet done
+  int mRemaining;
+  bool mStopping;
+};
+
+WorkerPool gWorkers;
+
+// Converts decoded YUV frames to 32 bit RGB, either with liboggplay's
+// oggplay_yuv2bgra/oggplay_yuv2argb or with our own kernels. Our kernels
+// support a choice of colour matrix and write to a destination with an
+// arbitrary pitch.
+class YUVConverter {
+  public:
+    YUVConverter() : mUseOggplay(true), mMatrix(YUV_BT601), mPool(0) {
+      select(detect_simd_level());
+      mUseOggplay = true;
+    }
+
+    void selectOggplay() {
+      mUseOggplay = true;
+    }
+
+    void select(SimdLevel level) {
+      mUseOggplay = false;
+      mLevel = level;
+      mRow = yuv_row_subsampled_scalar;
+#ifdef OGGPLAYER_X86
+      if (level == SIMD_AVX2)
+        mRow = yuv_row_avx2;
+      else if (level == SIMD_SSE2)
+        mRow = yuv_row_sse2;
+#endif
+    }
+
+    void setMatrix(YUVMatrix matrix) {
+      mMatrix = matrix;
+    }
+
+    // Convert frames of at least PARALLEL_PIXELS in bands on 'pool', or
+    // on the calling thread alone if 'pool' is null
+    void setPool(WorkerPool* pool) {
+      mPool = pool;
+    }
+
+    enum { PARALLEL_PIXELS = 640 * 360 };
+
+    const char* name() const {
+      return mUseOggplay ? "oggplay" : simd_level_name(mLevel);
+    }
+
+    // Whether frames 'width' pixels wide can be converted into a
+    // destination with 'pitch' bytes per row
+    bool supportsPitch(int width, int pitch) const {
+      return !mUseOggplay || pitch == width * 4;
+    }
+
+    // Converts the frame in 'yuv' into 'dest', which has 'pitch' bytes per row.
+    void convert(const OggPlayYUVChannels& yuv, unsigned char* dest, int pitch) const {
+      int bands = 1;
+      if (mPool && yuv.y_width * yuv.y_height >= PARALLEL_PIXELS)
+        bands = min(mPool->size(), yuv.y_height / 2);
+      if (bands < 2) {
+        convertRows(yuv, dest, pitch, 0, yuv.y_height);
+        return;
+      }
+      ConvertJob job(*this, yuv, dest, pitch, bands);
+      mPool->run(job, bands);
+    }
+
+    // Converts rows 'begin' up to 'end' of the frame in 'yuv'. 'begin' must
+    // be even so that it starts a row of subsampled chroma.
+    void convertRows(const OggPlayYUVChannels& yuv, unsigned char* dest, int pitch,
+                     int begin, int end) const {
+      if (mUseOggplay) {
+        // liboggplay always writes tightly packed rows, and converts whole
+        // frames, so give it the band as a frame of its own
+        assert(pitch == yuv.y_width * 4);
+        int uv_begin = begin * yuv.uv_height / yuv.y_height;
+        int uv_end = end == yuv.y_height ? yuv.uv_height : end * yuv.uv_height / yuv.y_height;
+        OggPlayYUVChannels band = yuv;
+        band.ptry += begin * yuv.y_width;
+        band.ptru += uv_begin * yuv.uv_width;
+        band.ptrv += uv_begin * yuv.uv_width;
+        band.y_height = end - begin;
+        band.uv_height = uv_end - uv_begin;
+        OggPlayRGBChannels rgb;
+        rgb.ptro = dest + begin * pitch;
+        rgb.rgb_width = yuv.y_width;
+        rgb.rgb_height = band.y_height;
+#if SDL_BYTE_ORDER == SDL_BIG_ENDIAN
+        oggplay_yuv2argb(&band, &rgb);
+#else
+        oggplay_yuv2bgra(&band, &rgb);
+#endif
+        return;
+      }
+
+      YUVCoefficients c = yuv_coefficients(mMatrix);
+      bool subsampled = yuv.uv_width < yuv.y_width;
+      for (int row=begin; row < end; ++row) {
+        int uv_row = row * yuv.uv_height / yuv.y_height;
+        const unsigned char* y = yuv.ptry + row * yuv.y_width;
+        const unsigned char* u = yuv.ptru + uv_row * yuv.uv_width;
+        const unsigned char* v = yuv.ptrv + uv_row * yuv.uv_width;
+        unsigned int* out = reinterpret_cast<unsigned int*>(dest + row * pitch);
+        if (subsampled)
+          mRow(y, u, v, out, yuv.y_width, c);
+        else
+          yuv_row_scalar(y, u, v, out, yuv.y_width, 0, c);
+      }
+    }
+
+  private:
+    // Converts one band of a frame per part
+    class ConvertJob : public WorkerPool::Job {
+    public:
+      ConvertJob(const YUVConverter& converter, const OggPlayYUVChannels& yuv,
+                 unsigned char* dest, int pitch, int bands)
+        : mConverter(converter), mYUV(yuv), mDest(dest), mPitch(pitch), mBands(bands) { }
+
+      void run(int part) {
+        mConverter.convertRows(mYUV, mDest, mPitch, start(part), start(part + 1));
+      }
+
+    private:
+      int start(int band) const {
+        return band == mBands ? mYUV.y_height : (mYUV.y_height * band / mBands) & ~1;
+      }
+
+      const YUVConverter& mConverter;
+      const OggPlayYUVChannels& mYUV;
+      unsigned char* mDest;
+      int mPitch;
+      int mBands;
+    };
+
+    bool mUseOggplay;
+    SimdLevel mLevel;
+    YUVMatrix mMatrix;
+    YUVRow mRow;
+    WorkerPool* mPool;
+};
+
+YUVConverter gYUVConverter;
+
+// Filters for resampling the planes of frames larger than the window
+// before they're converted.
+enum ScaleFilter {
+  SCALE_NEAREST,
+  SCALE_BILINEAR,
+  SCALE_BOX
+};
+
+const char* scale_filter_name(ScaleFilter filter) {
+  switch (filter) {
+    case SCALE_NEAREST: return "nearest";
+    case SCALE_BOX:     return "box";
+    default:            return "bilinear";
+  }
+}
+
+bool parse_scale_filter(const char* name, ScaleFilter& filter) {
+  if (strcmp(name, "nearest") == 0)
+    filter = SCALE_NEAREST;
+  else if (strcmp(name, "bilinear") == 0)
+    filter = SCALE_BILINEAR;
+  else if (strcmp(name, "box") == 0)
+    filter = SCALE_BOX;
+  else
+    return false;
+  return true;
+}
+
+// The largest size frames are shown at, set by --size. Larger frames are
+// scaled down to fit, keeping their aspect ratio. Zero means native size.
+struct ScalePolicy {
+  ScalePolicy() : maxWidth(0), maxHeight(0), filter(SCALE_BILINEAR) { }
+
+  // Sets 'width' x 'height' and the chroma size to fit a frame of the given
+  // size, returning false if it already fits. Sizes stay multiples of the
+  // chroma subsampling.
+  bool fit(int y_width, int y_height, int uv_width, int uv_height,
+           int& width, int& height, int& uv_width_out, int& uv_height_out) const {
+    if (maxWidth <= 0 || (y_width <= maxWidth && y_height <= maxHeight))
+      return false;
+    double factor = min(double(maxWidth) / y_width, double(maxHeight) / y_height);
+    // Odd sized frames have the last chroma sample cover one pixel
+    int xs = (y_width + uv_width - 1) / max(uv_width, 1);
+    int ys = (y_height + uv_height - 1) / max(uv_height, 1);
+    width = max(int(y_width * factor) / xs * xs, xs);
+    height = max(int(y_height * factor) / ys * ys, ys);
+    uv_width_out = width / xs;
+    uv_height_out = height / ys;
+    return true;
+  }
+
+  int maxWidth;
+  int maxHeight;
+  ScaleFilter filter;
+};
+
+ScalePolicy gScalePolicy;
+
+// For one axis of a plane being scaled, the run of source samples each
+// output sample is made from and their weights, in 256ths summing to 256.
+struct ScaleTaps {
+  void build(ScaleFilter filter, int from, int to) {
+    first.resize(to);
+    count.resize(to);
+    offset.resize(to);
+    weights.clear();
+    double ratio = double(from) / to;
+    for (int i=0; i < to; ++i) {
+      offset[i] = weights.size();
+      if (filter == SCALE_NEAREST) {
+        first[i] = min(int((i + 0.5) * ratio), from - 1);
+        count[i] = 1;
+        weights.push_back(256);
+      }
+      else if (filter == SCALE_BILINEAR) {
+        double centre = max((i + 0.5) * ratio - 0.5, 0.0);
+        int left = min(int(centre), from - 1);
+        int w = int((centre - left) * 256 + 0.5);
+        if (w == 256) {
+          ++left;
+          w = 0;
+        }
+        first[i] = left;
+        if (w == 0 || left + 1 >= from) {
+          count[i] = 1;
+          weights.push_back(256);
+        }
+        else {
+          count[i] = 2;
+          weights.push_back(256 - w);
+          weights.push_back(w);
+        }
+      }
+      else {
+        // Each source sample is weighted by how much of it the output
+        // sample covers. Rounding the running total keeps the sum exact.
+        double begin = i * ratio, end = (i + 1) * ratio;
+        int lo = min(int(begin), from - 1);
+        int hi = max(min(int(ceil(end)), from), lo + 1);
+        first[i] = lo;
+        count[i] = hi - lo;
+        int done = 0;
+        for (int s=lo; s < hi; ++s) {
+          double covered = min(end, s + 1.0) - begin;
+          int total = s + 1 == hi ? 256 : int(covered / (end - begin) * 256 + 0.5);
+          weights.push_back(total - done);
+          done = total;
+        }
+      }
+    }
+
+    halves = to * 2 == from;
+    for (int i=0; halves && i < to; ++i) {
+      halves = first[i] == 2 * i && count[i] == 2 &&
+               weights[offset[i]] == 128 && weights[offset[i] + 1] == 128;
+    }
+  }
+
+  // Lays the taps out for scale_columns_ssse3(): for each block of BLOCK
+  // output samples, pshufb masks that gather every tap's samples from the
+  // 32 bytes at the block's base into 16 bit lanes, and the tap weights.
+  // Blocks whose taps don't fit in those 32 bytes get a base of -1.
+  void buildBlocks(int from) {
+    int to = first.size();
+    blockTaps = 0;
+    for (int i=0; i < to; ++i)
+      blockTaps = max(blockTaps, count[i]);
+    int blocks = to / BLOCK;
+    blockBase.assign(blocks, -1);
+    masks.assign(size_t(blocks) * blockTaps * 32, 0x80);
+    blockWeights.assign(size_t(blocks) * blockTaps * BLOCK, 0);
+    for (int b=0; b < blocks; ++b) {
+      int base = first[b * BLOCK];
+      int end = first[b * BLOCK + BLOCK - 1] + count[b * BLOCK + BLOCK - 1];
+      if (end - base > 32 || base + 32 > from)
+        continue;
+      blockBase[b] = base;
+      for (int k=0; k < blockTaps; ++k) {
+        unsigned char* mask = &masks[(size_t(b) * blockTaps + k) * 32];
+        short* w = &blockWeights[(size_t(b) * blockTaps + k) * BLOCK];
+        for (int j=0; j < BLOCK; ++j) {
+          int x = b * BLOCK + j;
+          // Missing taps read the first sample with no weight
+          int rel = first[x] + (k < count[x] ? k : 0) - base;
+          w[j] = k < count[x] ? weights[offset[x] + k] : 0;
+          if (rel < 16)
+            mask[2 * j] = rel;
+          else
+            mask[16 + 2 * j] = rel - 16;
+        }
+      }
+    }
+  }
+
+  enum { BLOCK = 8 };
+
+  vector<int> first;
+  vector<int> count;
+  vector<int> offset;
+  vector<unsigned short> weights;
+
+  // Whether each output sample is the mean of a pair of source samples, as
+  // bilinear and box filtering give when halving a size
+  bool halves;
+
+  int blockTaps;
+  vector<int> blockBase;
+  vector<unsigned char> masks;
+  vector<short> blockWeights;
+};
+
+// Vertical pass kernels. Each writes the weighted sum of 'count' rows,
+// 'stride' bytes apart, for 'width' samples. Sums fit in 16 bits, so the
+// vector kernels match the scalar one exactly.
+typedef void (*ScaleRows)(const unsigned char* rows, int stride, const unsigned short* weights,
+                          int count, unsigned char* dest, int width);
+
+void scale_rows_scalar(const unsigned char* rows, int stride, const unsigned short* weights,
+                       int count, unsigned char* dest, int width) {
+  for (int x=0; x < width; ++x) {
+    unsigned int sum = 128;
+    for (int k=0; k < count; ++k)
+      sum += weights[k] * rows[k * stride + x];
+    dest[x] = sum >> 8;
+  }
+}
+
+#ifdef OGGPLAYER_X86
+__attribute__((target("sse2")))
+void scale_rows_sse2(const unsigned char* rows, int stride, const unsigned short* weights,
+                     int count, unsigned char* dest, int width) {
+  const __m128i zero = _mm_setzero_si128();
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    __m128i lo = _mm_set1_epi16(128);
+    __m128i hi = lo;
+    for (int k=0; k < count; ++k) {
+      __m128i w = _mm_set1_epi16(weights[k]);
+      __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows + k * stride + x));
+      lo = _mm_add_epi16(lo, _mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), w));
+      hi = _mm_add_epi16(hi, _mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), w));
+    }
+    __m128i packed = _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + x), packed);
+  }
+  scale_rows_scalar(rows + x, stride, weights, count, dest + x, width - x);
+}
+
+__attribute__((target("avx2")))
+void scale_rows_avx2(const unsigned char* rows, int stride, const unsigned short* weights,
+                     int count, unsigned char* dest, int width) {
+  int x = 0;
+  for (; x + 32 <= width; x += 32) {
+    __m256i lo = _mm256_set1_epi16(128);
+    __m256i hi = lo;
+    for (int k=0; k < count; ++k) {
+      __m256i w = _mm256_set1_epi16(weights[k]);
+      const unsigned char* s = rows + k * stride + x;
+      __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s)));
+      __m256i b = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(s + 16)));
+      lo = _mm256_add_epi16(lo, _mm256_mullo_epi16(a, w));
+      hi = _mm256_add_epi16(hi, _mm256_mullo_epi16(b, w));
+    }
+    __m256i packed = _mm256_packus_epi16(_mm256_srli_epi16(lo, 8), _mm256_srli_epi16(hi, 8));
+    packed = _mm256_permute4x64_epi64(packed, 0xd8);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + x), packed);
+  }
+  scale_rows_sse2(rows + x, stride, weights, count, dest + x, width - x);
+}
+#endif
+
+// Horizontal pass, one output sample at a time
+void scale_columns_scalar(const unsigned char* line, const ScaleTaps& taps,
+                          unsigned char* out, int begin, int end) {
+  for (int x=begin; x < end; ++x) {
+    const unsigned char* s = line + taps.first[x];
+    const unsigned short* w = &taps.weights[taps.offset[x]];
+    unsigned int sum = 128;
+    for (int k=0; k < taps.count[x]; ++k)
+      sum += w[k] * s[k];
+    out[x] = sum >> 8;
+  }
+}
+
+#ifdef OGGPLAYER_X86
+// Horizontal pass for ScaleTaps::halves, which is the rounded mean of each
+// pair of samples, exactly what pavgw computes
+__attribute__((target("sse2")))
+void scale_columns_halve_sse2(const unsigned char* line, const ScaleTaps& taps,
+                              unsigned char* out, int width) {
+  const __m128i even = _mm_set1_epi16(0xff);
+  int x = 0;
+  for (; x + 16 <= width; x += 16) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(line + 2 * x));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(line + 2 * x + 16));
+    __m128i lo = _mm_avg_epu16(_mm_and_si128(a, even), _mm_srli_epi16(a, 8));
+    __m128i hi = _mm_avg_epu16(_mm_and_si128(b, even), _mm_srli_epi16(b, 8));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x), _mm_packus_epi16(lo, hi));
+  }
+  scale_columns_scalar(line, taps, out, x, width);
+}
+
+// Horizontal pass in blocks of eight output samples laid out by
+// ScaleTaps::buildBlocks(), falling back to the scalar pass for blocks it
+// couldn't lay out and for the remainder.
+__attribute__((target("ssse3")))
+void scale_columns_ssse3(const unsigned char* line, const ScaleTaps& taps, unsigned char* out,
+                         int width) {
+  int blocks = taps.blockBase.size();
+  for (int b=0; b < blocks; ++b) {
+    int x = b * ScaleTaps::BLOCK;
+    int base = taps.blockBase[b];
+    if (base < 0) {
+      scale_columns_scalar(line, taps, out, x, x + ScaleTaps::BLOCK);
+      continue;
+    }
+    __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(line + base));
+    __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(line + base + 16));
+    __m128i sum = _mm_set1_epi16(128);
+    for (int k=0; k < taps.blockTaps; ++k) {
+      size_t tap = size_t(b) * taps.blockTaps + k;
+      const __m128i* mask = reinterpret_cast<const __m128i*>(&taps.masks[tap * 32]);
+      __m128i s = _mm_or_si128(_mm_shuffle_epi8(lo, _mm_loadu_si128(mask)),
+                               _mm_shuffle_epi8(hi, _mm_loadu_si128(mask + 1)));
+      __m128i w = _mm_loadu_si128(reinterpret_cast<const __m128i*>(
+                                    &taps.blockWeights[tap * ScaleTaps::BLOCK]));
+      sum = _mm_add_epi16(sum, _mm_mullo_epi16(s, w));
+    }
+    sum = _mm_srli_epi16(sum, 8);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(out + x), _mm_packus_epi16(sum, sum));
+  }
+  scale_columns_scalar(line, taps, out, blocks * ScaleTaps::BLOCK, width);
+}
+#endif
+
+// Scales one plane, vertically and then horizontally. Both passes are
+// vectorised: the vertical one blends whole source rows, the horizontal one
+// gathers taps with pshufb.
+class PlaneScaler {
+public:
+  PlaneScaler() : mFilter(SCALE_BILINEAR), mFromWidth(0), mFromHeight(0), mToWidth(0),
+                  mToHeight(0), mScratchSize(0), mRows(scale_rows_scalar),
+                  mColumnBlocks(false) {
+#ifdef OGGPLAYER_X86
+    SimdLevel level = detect_simd_level();
+    if (level == SIMD_AVX2)
+      mRows = scale_rows_avx2;
+    else if (level == SIMD_SSE2)
+      mRows = scale_rows_sse2;
+    mColumnBlocks = level != SIMD_SCALAR && __builtin_cpu_supports("ssse3");
+#endif
+  }
+
+  // Rebuilds the taps if any of the sizes or the filter have changed.
+  // 'parts' is how many bands may be scaled at once.
+  void setup(ScaleFilter filter, int from_width, int from_height, int to_width, int to_height,
+             int parts) {
+    if (filter != mFilter || from_width != mFromWidth || from_height != mFromHeight ||
+        to_width != mToWidth || to_height != mToHeight) {
+      mFilter = filter;
+      mFromWidth = from_width;
+      mFromHeight = from_height;
+      mToWidth = to_width;
+      mToHeight = to_height;
+      mColumns.build(filter, from_width, to_width);
+      if (mColumnBlocks)
+        mColumns.buildBlocks(from_width);
+      mLines.build(filter, from_height, to_height);
+    }
+    size_t scratch = size_t(parts) * from_width;
+    if (scratch > mScratchSize) {
+      mScratchSize = scratch;
+      mScratch.reset(new unsigned char[scratch]);
+    }
+  }
+
+  // Scales output rows 'begin' up to 'end' of 'from' into 'to', using the
+  // scratch row of band 'part'.
+  void scaleRows(const unsigned char* from, unsigned char* to, int begin, int end,
+                 int part) const {
+    unsigned char* scratch = mScratch.get() + size_t(part) * mFromWidth;
+    for (int row=begin; row < end; ++row) {
+      const unsigned char* line = from + size_t(mLines.first[row]) * mFromWidth;
+      int n = mLines.count[row];
+      if (n > 1 || mLines.weights[mLines.offset[row]] != 256) {
+        mRows(line, mFromWidth, &mLines.weights[mLines.offset[row]], n, scratch, mFromWidth);
+        line = scratch;
+      }
+      scaleColumns(line, to + size_t(row) * mToWidth);
+    }
+  }
+
+private:
+  void scaleColumns(const unsigned char* line, unsigned char* out) const {
+#ifdef OGGPLAYER_X86
+    if (mColumns.halves && mRows != scale_rows_scalar) {
+      scale_columns_halve_sse2(line, mColumns, out, mToWidth);
+      return;
+    }
+    if (mColumnBlocks) {
+      scale_columns_ssse3(line, mColumns, out, mToWidth);
+      return;
+    }
+#endif
+    if (mFilter == SCALE_NEAREST) {
+      for (int x=0; x < mToWidth; ++x)
+        out[x] = line[mColumns.first[x]];
+      return;
+    }
+    scale_columns_scalar(line, mColumns, out, 0, mToWidth);
+  }
+
+  ScaleFilter mFilter;
+  int mFromWidth;
+  int mFromHeight;
+  int mToWidth;
+  int mToHeight;
+  ScaleTaps mColumns;
+  ScaleTaps mLines;
+  // A row of vertically filtered samples per band
+  size_t mScratchSize;
+  scoped_array<unsigned char> mScratch;
+  ScaleRows mRows;
+  // Whether the CPU has SSSE3 for scale_columns_ssse3()
+  bool mColumnBlocks;
+};
+
+// Scales whole frames into planes it owns, in bands on the worker pool when
+// they're large, and keeps the cost per frame.
+class FrameScaler {
+public:
+  FrameScaler() : mCapacity(0) { }
+
+  // Scales 'from' to the size set in 'to', pointing 'to' at the result,
+  // which stays valid until the next call.
+  void scale(ScaleFilter filter, const OggPlayYUVChannels& from, OggPlayYUVChannels& to) {
+    StageTimer timer(Stats::YUV_SCALE, &gBenchmark.scale);
+    int64_t start = now_us();
+
+    int bands = 1;
+    if (from.y_width * from.y_height >= YUVConverter::PARALLEL_PIXELS)
+      bands = max(min(gWorkers.size(), to.uv_height), 1);
+    mLuma.setup(filter, from.y_width, from.y_height, to.y_width, to.y_height, bands);
+    mChroma.setup(filter, from.uv_width, from.uv_height, to.uv_width, to.uv_height, bands);
+
+    size_t y_size = size_t(to.y_width) * to.y_height;
+    size_t uv_size = size_t(to.uv_width) * to.uv_height;
+    if (y_size + 2 * uv_size > mCapacity) {
+      mCapacity = y_size + 2 * uv_size;
+      mPlanes.reset(new unsigned char[mCapacity]);
+    }
+    to.ptry = mPlanes.get();
+    to.ptru = to.ptry + y_size;
+    to.ptrv = to.ptru + uv_size;
+
+    ScaleJob job(*this, from, to, bands);
+    gWorkers.run(job, bands);
+
+    mFilter = filter;
+    mFrom = from;
+    mTo = to;
+    mCost.record(now_us() - start);
+  }
+
+  void report() const {
+    if (mCost.count() == 0)
+      return;
+    cout << "Scaling: " << mFrom.y_width << "x" << mFrom.y_height << " to "
+         << mTo.y_width << "x" << mTo.y_height << " " << scale_filter_name(mFilter)
+         << ", " << mCost.toString() << endl;
+  }
+
+private:
+  // Scales one band of each plane per part
+  class ScaleJob : public WorkerPool::Job {
+  public:
+    ScaleJob(const FrameScaler& scaler, const OggPlayYUVChannels& from,
+             const OggPlayYUVChannels& to, int bands)
+      : mScaler(scaler), mFrom(from), mTo(to), mBands(bands) { }
+
+    void run(int part) {
+      mScaler.mLuma.scaleRows(mFrom.ptry, mTo.ptry, start(mTo.y_height, part),
+                              start(mTo.y_height, part + 1), part);
+      int begin = start(mTo.uv_height, part), end = start(mTo.uv_height, part + 1);
+      mScaler.mChroma.scaleRows(mFrom.ptru, mTo.ptru, begin, end, part);
+      mScaler.mChroma.scaleRows(mFrom.ptrv, mTo.ptrv, begin, end, part);
+    }
+
+  private:
+    int start(int height, int band) const {
+      return height * band / mBands;
+    }
+
+    const FrameScaler& mScaler;
+    const OggPlayYUVChannels& mFrom;
+    const OggPlayYUVChannels& mTo;
+    int mBands;
+  };
+
+  PlaneScaler mLuma;
+  PlaneScaler mChroma;
+  scoped_array<unsigned char> mPlanes;
+  size_t mCapacity;
+
+  // The last frame scaled, for the report
+  ScaleFilter mFilter;
+  OggPlayYUVChannels mFrom;
+  OggPlayYUVChannels mTo;
+  Histogram mCost;
+};
+
+// A synthetic 4:2:0 frame for benchmarking conversion
+struct BenchmarkFrame {
+  BenchmarkFrame(int width, int height)
+    : y(width * height), u(width * height / 4), v(width * height / 4), rgb(width * height * 4)
+  {
+    for (size_t j=0; j < y.size(); ++j)
+      y[j] = (j * 7) & 0xff;
+    for (size_t j=0; j < u.size(); ++j) {
+      u[j] = (j * 3) & 0xff;
+      v[j] = (j * 5) & 0xff;
+    }
+    yuv.ptry = &y[0];
+    yuv.ptru = &u[0];
+    yuv.ptrv = &v[0];
+    yuv.y_width = width;
+    yuv.y_height = height;
+    yuv.uv_width = width / 2;
+    yuv.uv_height = height / 2;
+  }
+
+  // Milliseconds 'converter' takes per frame, run for at least half a
+  // second to smooth out noise
+  double time(const YUVConverter& converter) {
+    int frames = 0;
+    ptime start(microsec_clock::universal_time());
+    time_duration elapsed;
+    do {
+      converter.convert(yuv, &rgb[0], yuv.y_width * 4);
+      ++frames;
+      elapsed = microsec_clock::universal_time() - start;
+    } while (elapsed.total_milliseconds() < 500);
+    return elapsed.total_microseconds() / 1000.0 / frames;
+  }
+
+  vector<unsigned char> y, u, v, rgb;
+  OggPlayYUVChannels yuv;
+};
+
+// Times each available YUV converter on synthetic frames of common sizes and
+// reports which is fastest, so we know which to deploy on this machine.
+void benchmark_yuv_converters() {
+  static const int sizes[][2] = { { 640, 480 }, { 1280, 720 }, { 1920, 1080 }, { 3840, 2160 } };
+  static const char* names[] = { "oggplay", "scalar", "sse2", "avx2" };
+  SimdLevel best = detect_simd_level();
+
+  cout << "YUV 4:2:0 to RGB conversion, CPU supports " << simd_level_name(best) << endl;
+  for (size_t i=0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+    int width = sizes[i][0], height = sizes[i][1];
+    BenchmarkFrame frame(width, height);
+
+    const char* fastest = 0;
+    double fastest_ms = 0;
+    for (size_t k=0; k < sizeof(names) / sizeof(names[0]); ++k) {
+      YUVConverter converter;
+      SimdLevel level;
+      if (k == 0)
+        converter.selectOggplay();
+      else if (parse_simd_level(names[k], level))
+        converter.select(level);
+      else
+        continue;
+
+      double ms = frame.time(converter);
+      cout << "  " << width << "x" << height << " " << names[k] << ": "
+           << ms << " ms/frame, " << (width * height / ms / 1000.0) << " Mpixels/s" << endl;
+      if (!fastest || ms < fastest_ms) {
+        fastest = names[k];
+        fastest_ms = ms;
+      }
+    }
+    cout << "  " << width << "x" << height << " fastest: " << fastest << endl;
+  }
+
+  // How conversion of a 4K frame in bands scales with threads
+  BenchmarkFrame frame(3840, 2160);
+  YUVConverter converter;
+  converter.select(best);
+  int cores = processor_count();
+  double one_ms = 0;
+  cout << "Row-parallel " << simd_level_name(best) << " conversion at 3840x2160, "
+       << cores << " processors" << endl;
+  for (int threads=1; ; threads = min(threads * 2, cores)) {
+    WorkerPool pool;
+    pool.start(threads - 1);
+    converter.setPool(&pool);
+    double ms = frame.time(converter);
+    if (threads == 1)
+      one_ms = ms;
+    cout << "  " << threads << " threads: " << ms << " ms/frame, " << one_ms / ms << "x" << endl;
+    converter.setPool(0);
+    if (threads == cores)
+      break;
+  }
+
+  // What scaling 4K frames down for a 1080p window (--size) saves
+  BenchmarkFrame small(1920, 1080);
+  double convert_ms = small.time(converter);
+  cout << "Scaling 3840x2160 to 1920x1080 before " << simd_level_name(best)
+       << " conversion, one thread (4K conversion alone: " << one_ms << " ms/frame)" << endl;
+  static const ScaleFilter filters[] = { SCALE_NEAREST, SCALE_BILINEAR, SCALE_BOX };
+  for (size_t i=0; i < sizeof(filters) / sizeof(filters[0]); ++i) {
+    FrameScaler scaler;
+    OggPlayYUVChannels scaled = small.yuv;
+    int frames = 0;
+    ptime start(microsec_clock::universal_time());
+    time_duration elapsed;
+    do {
+      scaler.scale(filters[i], frame.yuv, scaled);
+      ++frames;
+      elapsed = microsec_clock::universal_time() - start;
+    } while (elapsed.total_milliseconds() < 500);
+    double scale_ms = elapsed.total_microseconds() / 1000.0 / frames;
+    cout << "  " << scale_filter_name(filters[i]) << ": " << scale_ms << " ms/frame scaling + "
+         << convert_ms << " converting, " << one_ms / (scale_ms + convert_ms) << "x" << endl;
+  }
+}
+
+// Scratch buffers for the per-callback conversions, owned by a play session.
+// A slot is only reallocated when a request needs more room than it already
+// has, which happens when the stream's dimensions or channel count change,
+// so in steady state no allocations are made. The counters let us check that.
+class BufferPool {
+  public:
+    enum Slot {
+      AUDIO_SAMPLES,
+      NUM_SLOTS
+    };
+
+  public:
+    BufferPool() : mRequests(0), mAllocations(0) {
+      for (int i=0; i < NUM_SLOTS; ++i)
+        mSizes[i] = 0;
+    }
+
+    // Returns a buffer with room for at least 'count' objects of type T. The
+    // contents are undefined and only valid until the next get() on the slot.
+    template <class T>
+    T* get(Slot slot, size_t count) {
+      size_t bytes = count * sizeof(T);
+      ++mRequests;
+      if (bytes > mSizes[slot]) {
+        mBuffers[slot].reset(new unsigned char[bytes]);
+        mSizes[slot] = bytes;
+        ++mAllocations;
+      }
+      return reinterpret_cast<T*>(mBuffers[slot].get());
+    }
+
+    unsigned long requests() const {
+      return mRequests;
+    }
+
+    unsigned long allocations() const {
+      return mAllocations;
+    }
+
+    size_t bytesHeld() const {
+      size_t total = 0;
+      for (int i=0; i < NUM_SLOTS; ++i)
+        total += mSizes[i];
+      return total;
+    }
+
+  private:
+    scoped_array<unsigned char> mBuffers[NUM_SLOTS];
+    size_t mSizes[NUM_SLOTS];
+    unsigned long mRequests;
+    unsigned long mAllocations;
+};
+
+// Writes audio to the sound device from a thread of its own.
+// sa_stream_write() blocks while the device buffer is full, which held up
+// video when it was called from the main loop. Now the main loop only queues
+// converted samples in a single producer, single consumer ring. Neither side
+// takes a lock to move data. The semaphores only wake a side that has run
+// out of work.
+class AudioOutput {
+public:
+  AudioOutput(shared_ptr<sa_stream_t> sound, int rate, int channels)
+    : mSound(sound),
+      mThread(0),
+      mSamplesPerSecond(rate * channels),
+      mCapacity(1),
+      mChunk(std::max(rate * channels / 50, 1)),
+      mHead(0),
+      mTail(0),
+      mWrittenBytes(0),
+      mDataAvailable(SDL_CreateSemaphore(0)),
+      mSpaceAvailable(SDL_CreateSemaphore(0)),
+      mConsumerWaiting(0),
+      mProducerWaiting(0),
+      mFlushRequested(0),
+      mStopping(0),
+      mDrain(false),
+      mPeakDepth(0),
+      mRingWaits(0),
+      mUnderruns(0),
+      mWrites(0)
+  {
+    // Room for at least a second of audio
+    while (mCapacity < static_cast<size_t>(mSamplesPerSecond))
+      mCapacity <<= 1;
+    mRing.reset(new short[mCapacity]);
+  }
+
+  ~AudioOutput() {
+    stop(false);
+    SDL_DestroySemaphore(mSpaceAvailable);
+    SDL_DestroySemaphore(mDataAvailable);
+  }
+
+  bool start() {
+    assert(!mThread);
+    mThread = SDL_CreateThread(audio_thread, this);
+    return mThread != 0;
+  }
+
+  // Stop the thread. If 'drain' is true the audio still queued is written
+  // first, otherwise it is discarded.
+  void stop(bool drain) {
+    if (!mThread)
+      return;
+    mDrain = drain;
+    __sync_fetch_and_or(&mStopping, 1);
+    wake(mConsumerWaiting, mDataAvailable);
+    SDL_WaitThread(mThread, NULL);
+    mThread = 0;
+  }
+
+  // Queue 'count' samples. Only blocks if the ring is full, which paces the
+  // main loop when there is no video to do it. Main thread only.
+  void write(const short* samples, size_t count) {
+    while (count > 0) {
+      size_t head = mHead;
+      size_t space = mCapacity - (head - load(mTail));
+      if (space == 0) {
+        ++mRingWaits;
+        gStats.count(Stats::AUDIO_RING_WAITS);
+        __sync_fetch_and_or(&mProducerWaiting, 1);
+        if (load(mTail) + mCapacity == head)
+          SDL_SemWaitTimeout(mSpaceAvailable, 100);
+        __sync_fetch_and_and(&mProducerWaiting, 0);
+        continue;
+      }
+
+      size_t n = std::min(count, space);
+      size_t offset = head & (mCapacity - 1);
+      size_t first = std::min(n, mCapacity - offset);
+      memcpy(mRing.get() + offset, samples, first * sizeof(short));
+      memcpy(mRing.get(), samples + first, (n - first) * sizeof(short));
+      __sync_synchronize();
+      mHead = head + n;
+      wake(mConsumerWaiting, mDataAvailable);
+
+      samples += n;
+      count -= n;
+    }
+
+    size_t depth = this->depth();
+    if (depth > mPeakDepth)
+      mPeakDepth = depth;
+    int64_t lag = static_cast<int64_t>(depth) * 1000000 / mSamplesPerSecond;
+    mLag.record(lag);
+    gStats.record(Stats::AUDIO_LAG, lag);
+  }
+
+  // Discard queued audio that hasn't been written to the device yet, e.g.
+  // after a seek. Waits for a write in progress to finish. Main thread only.
+  void flush() {
+    if (!mThread) {
+      mTail = mHead;
+      return;
+    }
+    __sync_fetch_and_or(&mFlushRequested, 1);
+    wake(mConsumerWaiting, mDataAvailable);
+    while (load(mFlushRequested)) {
+      __sync_fetch_and_or(&mProducerWaiting, 1);
+      if (load(mFlushRequested))
+        SDL_SemWaitTimeout(mSpaceAvailable, 100);
+      __sync_fetch_and_and(&mProducerWaiting, 0);
+    }
+  }
+
+  // Number of samples queued but not yet written to the device
+  size_t depth() {
+    return load(mHead) - load(mTail);
+  }
+
+  // Bytes written to the device so far
+  int64_t writtenBytes() {
+    return __sync_fetch_and_add(&mWrittenBytes, 0);
+  }
+
+  void report() const {
+    cout << "Audio output: " << mWrites << " device writes, "
+         << mUnderruns << " underruns, "
+         << mRingWaits << " waits for ring space" << endl;
+    cout << "  ring " << mCapacity << " samples (" << toMs(mCapacity)
+         << " ms), peak depth " << mPeakDepth << " samples ("
+         << toMs(mPeakDepth) << " ms)" << endl;
+    cout << "  lag: " << mLag.toString() << endl;
+  }
+
+private:
+  static int audio_thread(void* data) {
+    static_cast<AudioOutput*>(data)->run();
+    return 0;
+  }
+
+  void run() {
+    // Set once the device has been given audio, and cleared when it runs
+    // out, so that each underrun is only counted once.
+    bool playing = false;
+    bool starved = false;
+    for (;;) {
+      if (load(mFlushRequested)) {
+        mTail = load(mHead);
+        playing = starved = false;
+        __sync_fetch_and_and(&mFlushRequested, 0);
+        wake(mProducerWaiting, mSpaceAvailable);
+      }
+
+      size_t tail = mTail;
+      size_t available = load(mHead) - tail;
+      bool stopping = load(mStopping);
+      if (stopping && (available == 0 || !mDrain))
+        break;
+
+      if (available == 0) {
+        starved = playing;
+        __sync_fetch_and_or(&mConsumerWaiting, 1);
+        if (load(mHead) == tail && !load(mStopping) && !load(mFlushRequested))
+          SDL_SemWaitTimeout(mDataAvailable, 100);
+        __sync_fetch_and_and(&mConsumerWaiting, 0);
+        continue;
+      }
+
+      // The ring ran dry. It only counts as an underrun if the device also
+      // finished playing what it had before more audio arrived.
+      if (starved) {
+        starved = false;
+        int64_t played = 0;
+        if (sa_stream_get_position(mSound.get(), SA_POSITION_WRITE_SOFTWARE, &played) == SA_SUCCESS &&
+            played >= writtenBytes()) {
+          ++mUnderruns;
+          gStats.count(Stats::AUDIO_UNDERRUNS);
+        }
+      }
+
+      size_t offset = tail & (mCapacity - 1);
+      size_t n = std::min(available, std::min(mCapacity - offset, mChunk));
+      {
+        StageTimer timer(Stats::AUDIO_WRITE);
+        int sr = sa_stream_write(mSound.get(), mRing.get() + offset, n * sizeof(short));
+        assert(sr == SA_SUCCESS);
+      }
+      ++mWrites;
+      playing = true;
+      __sync_fetch_and_add(&mWrittenBytes, n * sizeof(short));
+      __sync_synchronize();
+      mTail = tail + n;
+      wake(mProducerWaiting, mSpaceAvailable);
+    }
+  }
+
+  // Post 'sem' if the other side announced in 'waiting' that it is about to
+  // sleep on it.
+  static void wake(volatile int& waiting, SDL_sem* sem) {
+    if (__sync_bool_compare_and_swap(&waiting, 1, 0))
+      SDL_SemPost(sem);
+  }
+
+  template <class T>
+  static T load(volatile T& v) {
+    return __sync_fetch_and_add(&v, 0);
+  }
+
+  long toMs(size_t samples) const {
+    return static_cast<long>(static_cast<int64_t>(samples) * 1000 / mSamplesPerSecond);
+  }
+
+private:
+  shared_ptr<sa_stream_t> mSound;
+  SDL_Thread* mThread;
+  int mSamplesPerSecond;
+
+  // Ring of mCapacity samples, a power of two. mHead and mTail count the
+  // samples ever queued and written. Only the main thread advances mHead
+  // and only the audio thread advances mTail.
+  scoped_array<short> mRing;
+  size_t mCapacity;
+  size_t mChunk;
+  volatile size_t mHead;
+  volatile size_t mTail;
+  volatile int64_t mWrittenBytes;
+
+  SDL_sem* mDataAvailable;
+  SDL_sem* mSpaceAvailable;
+  volatile int mConsumerWaiting;
+  volatile int mProducerWaiting;
+  volatile int mFlushRequested;
+  volatile int mStopping;
+  bool mDrain;
+
+  // Main thread statistics
+  size_t mPeakDepth;
+  unsigned long mRingWaits;
+  Histogram mLag;
+
+  // Audio thread statistics, read once it has stopped
+  unsigned long mUnderruns;
+  unsigned long mWrites;
+};
+
+// Process the audio data provided by liboggplay. 'count' is the number of
+// floats contained within 'data'. 'output' may be null when benchmarking, in
+// which case the data is converted but not played.
+void handle_audio_data(AudioOutput* output, BufferPool& pool, OggPlayAudioData* data, int count) {
+  StageTimer timer(Stats::AUDIO_RECORD);
+  gStats.count(Stats::AUDIO_RECORDS);
+  gStats.count(Stats::AUDIO_SAMPLES, count);
+
+  // Convert float data to S16 LE
+  short* dest = pool.get<short>(BufferPool::AUDIO_SAMPLES, count);
+  {
+    StageTimer timer(Stats::AUDIO_CONVERT, &gBenchmark.audio);
+    gAudioConverter.convert(reinterpret_cast<float*>(data), dest, count);
+  }
+
+  if (output)
+    output->write(dest, count);
+}
+
+// Counts how frames reach the screen and the bytes copied to get them there
+// once they're in RGB, to show what writing straight into the screen saves.
+class PresentationStats {
+public:
+  enum Path {
+    // Converted or copied straight into the screen's pixels
+    DIRECT,
+    // Converted into a buffer which is blitted to the screen
+    BLIT,
+    // Uploaded to an SDL YUV overlay
+    OVERLAY,
+    NUM_PATHS
+  };
+
+  PresentationStats() : mBytesCopied(0), mBytesSaved(0) {
+    for (int i=0; i < NUM_PATHS; ++i)
+      mFrames[i] = 0;
+  }
+
+  // A frame was presented by 'path', copying 'copied' bytes after
+  // conversion, where a blit would have copied 'copied' + 'saved'
+  void frame(Path path, uint64_t copied, uint64_t saved = 0) {
+    ++mFrames[path];
+    mBytesCopied += copied;
+    mBytesSaved += saved;
+  }
+
+  void report() const {
+    unsigned long frames = mFrames[DIRECT] + mFrames[BLIT] + mFrames[OVERLAY];
+    if (frames == 0)
+      return;
+    cout << "Presentation: " << mFrames[DIRECT] << " frames written into the screen, "
+         << mFrames[BLIT] << " blitted, " << mFrames[OVERLAY] << " by overlay; "
+         << mBytesCopied / frames << " bytes copied per frame, "
+         << (mBytesCopied + mBytesSaved) / frames << " if blitted" << endl;
+  }
+
+private:
+  unsigned long mFrames[NUM_PATHS];
+  uint64_t mBytesCopied;
+  uint64_t mBytesSaved;
+};
+
+PresentationStats gPresentation;
+
+// Returns true if frames of 'width' x 'height' in the 32 bit format that the
+// YUV converters and liboggplay's Kate renderer produce can be written
+// straight into 'screen'. Otherwise they have to be blitted, which converts
+// them to the screen's format.
+bool screen_takes_rgb(SDL_Surface* screen, int width, int height) {
+  const SDL_PixelFormat* f = screen->format;
+  return gSDL.present_direct &&
+         f->BytesPerPixel == 4 &&
+         f->Rmask == 0x00ff0000 && f->Gmask == 0x0000ff00 && f->Bmask == 0x000000ff &&
+         screen->w >= width && screen->h >= height;
+}
+
+// The subtitle bitmap liboggplay's tiger renderer last delivered for a Kate
+// track shown over YUV video. Tiger only delivers a bitmap when what it
+// draws changes, so each one is cropped to the pixels it covers and kept
+// until the next. Every frame then only blends that rectangle, rather than
+// going through liboggplay's full frame RGB compositing.
+class SubtitleCache {
+public:
+  SubtitleCache() : mX(0), mY(0), mWidth(0), mHeight(0), mHaveYUV(false), mBitmaps(0) { }
+
+  bool empty() const {
+    return mWidth == 0;
+  }
+
+  unsigned long bitmaps() const {
+    return mBitmaps;
+  }
+
+  // Crops a newly rendered bitmap, which is premultiplied ARGB in native
+  // byte order, to the rectangle with any alpha in it
+  void update(OggPlayOverlayData* data) {
+    StageTimer timer(Stats::SUBTITLE_CACHE);
+    int64_t start = now_us();
+    ++mBitmaps;
+    mHaveYUV = false;
+
+    const unsigned char* rgba = data->rgba ? data->rgba : data->rgb;
+    int stride = data->stride > 0 ? data->stride : data->width * 4;
+    int left = data->width, right = 0, top = data->height, bottom = 0;
+    for (int y=0; y < data->height; ++y) {
+      const unsigned int* row = reinterpret_cast<const unsigned int*>(rgba + y * stride);
+      for (int x=0; x < data->width; ++x) {
+        if (row[x] >> 24) {
+          left = min(left, x);
+          right = max(right, x + 1);
+          top = min(top, y);
+          bottom = y + 1;
+        }
+      }
+    }
+
+    // Even so that the rectangle covers whole chroma samples
+    mX = left & ~1;
+    mY = top & ~1;
+    mWidth = right > left ? ((right + 1) & ~1) - mX : 0;
+    mHeight = bottom > top ? ((bottom + 1) & ~1) - mY : 0;
+    mPixels.assign(size_t(mWidth) * mHeight, 0);
+    for (int y=0; y < mHeight && mY + y < data->height; ++y) {
+      const unsigned int* row = reinterpret_cast<const unsigned int*>(rgba + (mY + y) * stride);
+      int width = min(mWidth, data->width - mX);
+      memcpy(&mPixels[size_t(y) * mWidth], row + mX, width * 4);
+    }
+    mCache.record(now_us() - start);
+  }
+
+  // Blends the subtitles onto a 'width' x 'height' frame of 32 bit xRGB
+  // with rows 'pitch' bytes apart
+  void blendRGB(unsigned char* dest, int pitch, int width, int height) {
+    if (empty())
+      return;
+    StageTimer timer(Stats::SUBTITLE_BLEND);
+    int64_t start = now_us();
+    int w = min(mWidth, width - mX), h = min(mHeight, height - mY);
+    for (int y=0; y < h; ++y) {
+      const unsigned int* s = &mPixels[size_t(y) * mWidth];
+      unsigned int* d = reinterpret_cast<unsigned int*>(dest + (mY + y) * pitch) + mX;
+      for (int x=0; x < w; ++x) {
+        unsigned int a = s[x] >> 24;
+        if (a == 255)
+          d[x] = s[x];
+        else if (a) {
+          unsigned int r = ((s[x] >> 16) & 0xff) + div255(((d[x] >> 16) & 0xff) * (255 - a));
+          unsigned int g = ((s[x] >> 8) & 0xff) + div255(((d[x] >> 8) & 0xff) * (255 - a));
+          unsigned int b = (s[x] & 0xff) + div255((d[x] & 0xff) * (255 - a));
+          d[x] = 0xff000000 | (min(r, 255u) << 16) | (min(g, 255u) << 8) | min(b, 255u);
+        }
+      }
+    }
+    mBlend.record(now_us() - start);
+  }
+
+  // Blends the subtitles onto a YV12 overlay, converting the bitmap to YUV
+  // the first time it's needed
+  void blendYUV(SDL_Overlay* overlay, int width, int height) {
+    if (empty())
+      return;
+    StageTimer timer(Stats::SUBTITLE_BLEND);
+    int64_t start = now_us();
+    if (!mHaveYUV)
+      convertToYUV();
+    int w = min(mWidth, width - mX), h = min(mHeight, height - mY);
+    for (int y=0; y < h; ++y) {
+      blendRow(overlay->pixels[0] + (mY + y) * overlay->pitches[0] + mX,
+               &mLuma[size_t(y) * mWidth], &mAlpha[size_t(y) * mWidth], w);
+    }
+    // YV12 has the V plane before the U plane
+    int uv_width = mWidth / 2;
+    for (int y=0; y < h / 2; ++y) {
+      const unsigned char* alpha = &mChromaAlpha[size_t(y) * uv_width];
+      blendRow(overlay->pixels[2] + (mY / 2 + y) * overlay->pitches[2] + mX / 2,
+               &mU[size_t(y) * uv_width], alpha, w / 2);
+      blendRow(overlay->pixels[1] + (mY / 2 + y) * overlay->pitches[1] + mX / 2,
+               &mV[size_t(y) * uv_width], alpha, w / 2);
+    }
+    mBlend.record(now_us() - start);
+  }
+
+  void report() const {
+    if (mBitmaps == 0)
+      return;
+    cout << "Subtitles: " << mBitmaps << " bitmaps cached, last " << mWidth << "x" << mHeight
+         << " at " << mX << "," << mY << "; caching " << mCache.toString() << endl;
+    cout << "Subtitle blending: " << mBlend.toString() << endl;
+  }
+
+private:
+  // x / 255, rounded, for x up to 255 * 255
+  static unsigned int div255(unsigned int x) {
+    return (x + 128 + ((x + 128) >> 8)) >> 8;
+  }
+
+  static void blendRow(unsigned char* dest, const unsigned char* from,
+                       const unsigned char* alpha, int width) {
+    for (int x=0; x < width; ++x) {
+      if (alpha[x])
+        dest[x] = div255(from[x] * alpha[x] + dest[x] * (255 - alpha[x]));
+    }
+  }
+
+  // Video range BT.601 samples with straight alpha, chroma averaged over
+  // each 2x2 block
+  void convertToYUV() {
+    size_t size = size_t(mWidth) * mHeight;
+    mLuma.resize(size);
+    mAlpha.resize(size);
+    vector<int> u(size), v(size);
+    for (size_t i=0; i < size; ++i) {
+      unsigned int p = mPixels[i], a = p >> 24;
+      int r = 0, g = 0, b = 0;
+      if (a) {
+        // Undo the premultiplication
+        r = min(((p >> 16) & 0xff) * 255 / a, 255u);
+        g = min(((p >> 8) & 0xff) * 255 / a, 255u);
+        b = min((p & 0xff) * 255 / a, 255u);
+      }
+      mLuma[i] = 16 + ((66 * r + 129 * g + 25 * b + 128) >> 8);
+      u[i] = 128 + ((-38 * r - 74 * g + 112 * b + 128) >> 8);
+      v[i] = 128 + ((112 * r - 94 * g - 18 * b + 128) >> 8);
+      mAlpha[i] = a;
+    }
+
+    int uv_width = mWidth / 2, uv_height = mHeight / 2;
+    mU.resize(size_t(uv_width) * uv_height);
+    mV.resize(mU.size());
+    mChromaAlpha.resize(mU.size());
+    for (int y=0; y < uv_height; ++y) {
+      for (int x=0; x < uv_width; ++x) {
+        size_t i = size_t(2 * y) * mWidth + 2 * x, j = i + mWidth;
+        int a = mAlpha[i] + mAlpha[i + 1] + mAlpha[j] + mAlpha[j + 1];
+        size_t k = size_t(y) * uv_width + x;
+        mChromaAlpha[k] = a / 4;
+        // Weight each sample by its alpha so transparent pixels don't tint
+        // the edges of the text
+        if (a) {
+          mU[k] = (u[i] * mAlpha[i] + u[i + 1] * mAlpha[i + 1] + u[j] * mAlpha[j] +
+                   u[j + 1] * mAlpha[j + 1] + a / 2) / a;
+          mV[k] = (v[i] * mAlpha[i] + v[i + 1] * mAlpha[i + 1] + v[j] * mAlpha[j] +
+                   v[j + 1] * mAlpha[j + 1] + a / 2) / a;
+        }
+        else {
+          mU[k] = 128;
+          mV[k] = 128;
+        }
+      }
+    }
+    mHaveYUV = true;
+  }
+
+  // The cropped bitmap and where it goes
+  int mX;
+  int mY;
+  int mWidth;
+  int mHeight;
+  vector<unsigned int> mPixels;
+
+  // The same converted for YV12 overlays
+  bool mHaveYUV;
+  vector<unsigned char> mLuma;
+  vector<unsigned char> mAlpha;
+  vector<unsigned char> mU;
+  vector<unsigned char> mV;
+  vector<unsigned char> mChromaAlpha;
+
+  unsigned long mBitmaps;
+  Histogram mCache;
+  Histogram mBlend;
+};
+
+// Keeps what presenting frames needs from one frame to the next: their
+// dimensions, the screen, a pair of YUV overlays for --sdl-yuv and an RGB
+// surface to blit from when frames can't be converted straight into the
+// screen. These are only recreated when the frame size changes, as it can
+// when a chained stream starts. The overlays are used in turn, so that a
+// frame is uploaded to one while the other may still be being displayed.
+//
+// Frames are shown in two steps. prepareYUV() or prepareRGB() converts the
+// frame into the screen's back buffer (or an overlay), which can be done
+// before the frame is due. flip() then displays the overlay, draws the seek
+// bar and makes it visible, which is all that has to wait for the deadline.
+// The seek bar is drawn last because SDL's software overlays are converted
+// into the screen when they're displayed.
+class Presenter {
+public:
+  Presenter(shared_ptr<SDL_Surface>& screen)
+    : mScreen(screen),
+      mWidth(0),
+      mHeight(0),
+      mUVWidth(0),
+      mUVHeight(0),
+      mNextOverlay(0),
+      mReady(0),
+      mPrepared(false),
+      mResizes(0)
+  {
+  }
+
+  // Prepares the YUV frame 'data' of 'video'
+  void prepareYUV(shared_ptr<Track> video, OggPlayVideoData* data) {
+    // liboggplay only reports a change of frame size through these calls,
+    // which read fields of its decoder, so they're cheap to make per frame
+    int y_width, y_height, uv_width, uv_height;
+    int r = oggplay_get_video_y_size(video->mPlayer.get(), video->mIndex, &y_width, &y_height);
+    assert(r == E_OGGPLAY_OK);
+    r = oggplay_get_video_uv_size(video->mPlayer.get(), video->mIndex, &uv_width, &uv_height);
+    assert(r == E_OGGPLAY_OK);
+
+    // Frames larger than --size are scaled down first, which costs less
+    // than converting them at full size
+    OggPlayYUVChannels scaled;
+    OggPlayVideoData planes;
+    if (gScalePolicy.fit(y_width, y_height, uv_width, uv_height,
+                         scaled.y_width, scaled.y_height, scaled.uv_width, scaled.uv_height)) {
+      OggPlayYUVChannels frame;
+      frame.ptry = data->y;
+      frame.ptru = data->u;
+      frame.ptrv = data->v;
+      frame.y_width = y_width;
+      frame.y_height = y_height;
+      frame.uv_width = uv_width;
+      frame.uv_height = uv_height;
+      mScaler.scale(gScalePolicy.filter, frame, scaled);
+      planes.y = scaled.ptry;
+      planes.u = scaled.ptru;
+      planes.v = scaled.ptrv;
+      data = &planes;
+      y_width = scaled.y_width;
+      y_height = scaled.y_height;
+      uv_width = scaled.uv_width;
+      uv_height = scaled.uv_height;
+    }
+    resize(y_width, y_height, uv_width, uv_height);
+
+    int64_t start = now_us();
+    if (gSDL.use_sdl_yuv && mScreen)
+      upload(data);
+    else
+      convert(data);
+    mFrameUs[mSubtitles.empty() ? 0 : 1].record(now_us() - start);
+    finish();
+  }
+
+  // Prepares a frame of Kate subtitles that liboggplay has rendered on
+  // their own, when there's no video
+  void prepareRGB(OggPlayOverlayData* data) {
+    resize(data->width, data->height, 0, 0);
+    if (!mScreen)
+      return;
+
+    unsigned char* buffer = data->rgb ? data->rgb : data->rgba;
+    uint64_t bytes = uint64_t(mWidth) * mHeight * 4;
+
+    // liboggplay owns the frame, so it has to be copied, but a row by row
+    // copy into the screen saves a blit. Large frames are copied in bands
+    // on the worker pool.
+    if (screen_takes_rgb(mScreen.get(), mWidth, mHeight)) {
+      lock(mScreen.get());
+      int bands = mWidth * mHeight >= YUVConverter::PARALLEL_PIXELS ? gWorkers.size() : 1;
+      CopyJob job(static_cast<unsigned char*>(mScreen->pixels), mScreen->pitch, buffer,
+                  mWidth * 4, mHeight, bands);
+      gWorkers.run(job, bands);
+      unlock(mScreen.get());
+      gPresentation.frame(PresentationStats::DIRECT, bytes);
+    }
+    else {
+      // Wrapping the frame costs less than copying it into mRGB
+      shared_ptr<SDL_Surface> frame(SDL_CreateRGBSurfaceFrom(buffer, mWidth, mHeight, 32, 4 * mWidth,
+                                                             0x00ff0000, 0x0000ff00, 0x000000ff, 0),
+                                    SDL_FreeSurface);
+      assert(frame);
+      int r = SDL_BlitSurface(frame.get(), NULL, mScreen.get(), NULL);
+      assert(r == 0);
+      gPresentation.frame(PresentationStats::BLIT, bytes);
+    }
+    finish();
+  }
+
+  // Replaces the subtitles blended onto YUV frames
+  void updateSubtitles(OggPlayOverlayData* data) {
+    mSubtitles.update(data);
+  }
+
+  // Shows the frame last prepared, with 'seekBar' over it
+  void flip(SeekBar& seekBar) {
+    if (!mPrepared)
+      return;
+    mPrepared = false;
+    if (mReady) {
+      SDL_Rect rect;
+      rect.x = 0;
+      rect.y = 0;
+      rect.w = mWidth;
+      rect.h = mHeight;
+      SDL_DisplayYUVOverlay(mReady, &rect);
+      mReady = 0;
+    }
+    seekBar.draw(mScreen);
+    int r = SDL_Flip(mScreen.get());
+    assert(r == 0);
+  }
+
+  void report() const {
+    cout << "Presentation surfaces: " << mWidth << "x" << mHeight << ", recreated "
+         << mResizes << " times for size changes" << endl;
+    mScaler.report();
+    if (mSubtitles.bitmaps() > 0) {
+      mSubtitles.report();
+      cout << "Converting frames without subtitles: " << mFrameUs[0].toString() << endl;
+      cout << "Converting frames with subtitles: " << mFrameUs[1].toString() << endl;
+    }
+  }
+
+private:
+  // Recreates what depends on the frame size if it has changed
+  void resize(int width, int height, int uv_width, int uv_height) {
+    if (width == mWidth && height == mHeight && uv_width == mUVWidth && uv_height == mUVHeight)
+      return;
+    if (mWidth)
+      ++mResizes;
+    mWidth = width;
+    mHeight = height;
+    mUVWidth = uv_width;
+    mUVHeight = uv_height;
+
+    // The overlays belong to the screen, so they go before it changes
+    mOverlays[0].reset();
+    mOverlays[1].reset();
+    mReady = 0;
+    mRGB.reset();
+    if (!gSDL.fuzz_mode && (!mScreen || mScreen->w != width || mScreen->h != height)) {
+      mScreen = gSDL.setVideoMode(width, height, SDL_DOUBLEBUF);
+      assert(mScreen);
+    }
+  }
+
+  void upload(OggPlayVideoData* data) {
+    shared_ptr<SDL_Overlay>& overlay = mOverlays[mNextOverlay];
+    mNextOverlay ^= 1;
+    if (!overlay) {
+      overlay.reset(SDL_CreateYUVOverlay(mWidth, mHeight, SDL_YV12_OVERLAY, mScreen.get()),
+                    SDL_FreeYUVOverlay);
+      assert(overlay);
+    }
+
+    int r = SDL_LockYUVOverlay(overlay.get());
+    assert(r == 0);
+    // YV12 has the V plane before the U plane
+    uint64_t bytes = copyPlane(overlay->pixels[0], overlay->pitches[0], data->y, mWidth, mHeight);
+    bytes += copyPlane(overlay->pixels[2], overlay->pitches[2], data->u, mUVWidth, mUVHeight);
+    bytes += copyPlane(overlay->pixels[1], overlay->pitches[1], data->v, mUVWidth, mUVHeight);
+    mSubtitles.blendYUV(overlay.get(), mWidth, mHeight);
+    SDL_UnlockYUVOverlay(overlay.get());
+    gPresentation.frame(PresentationStats::OVERLAY, bytes);
+    mReady = overlay.get();
+  }
+
+  void convert(OggPlayVideoData* data) {
+    OggPlayYUVChannels yuv;
+    yuv.ptry = data->y;
+    yuv.ptru = data->u;
+    yuv.ptrv = data->v;
+    yuv.uv_width = mUVWidth;
+    yuv.uv_height = mUVHeight;
+    yuv.y_width = mWidth;
+    yuv.y_height = mHeight;
+    uint64_t bytes = uint64_t(mWidth) * mHeight * 4;
+
+    if (mScreen && screen_takes_rgb(mScreen.get(), mWidth, mHeight) &&
+        gYUVConverter.supportsPitch(mWidth, mScreen->pitch)) {
+      lock(mScreen.get());
+      {
+        StageTimer timer(Stats::YUV_CONVERT, &gBenchmark.yuv);
+        gYUVConverter.convert(yuv, static_cast<unsigned char*>(mScreen->pixels), mScreen->pitch);
+      }
+      mSubtitles.blendRGB(static_cast<unsigned char*>(mScreen->pixels), mScreen->pitch,
+                          mWidth, mHeight);
+      unlock(mScreen.get());
+      gPresentation.frame(PresentationStats::DIRECT, 0, bytes);
+      return;
+    }
+
+    // Without a screen, as when benchmarking, frames are still converted
+    if (!mRGB)
+      createRGB();
+    {
+      StageTimer timer(Stats::YUV_CONVERT, &gBenchmark.yuv);
+      gYUVConverter.convert(yuv, static_cast<unsigned char*>(mRGB->pixels), mRGB->pitch);
+    }
+    mSubtitles.blendRGB(static_cast<unsigned char*>(mRGB->pixels), mRGB->pitch, mWidth, mHeight);
+    if (mScreen) {
+      int r = SDL_BlitSurface(mRGB.get(), NULL, mScreen.get(), NULL);
+      assert(r == 0);
+      gPresentation.frame(PresentationStats::BLIT, bytes);
+    }
+  }
+
+  // A surface in the format the YUV converters write, with rows that they
+  // all support
+  void createRGB() {
+    mRGB.reset(SDL_CreateRGBSurface(SDL_SWSURFACE, mWidth, mHeight, 32,
+                                    0x00ff0000, 0x0000ff00, 0x000000ff, 0),
+               SDL_FreeSurface);
+    assert(mRGB);
+    assert(gYUVConverter.supportsPitch(mWidth, mRGB->pitch));
+  }
+
+  void finish() {
+    if (!mScreen)
+      return;
+    mPrepared = true;
+  }
+
+  // Copies 'height' rows of 'width' bytes, packed as liboggplay delivers
+  // them, to 'to', which has rows 'pitch' bytes apart. Returns the bytes
+  // copied.
+  static uint64_t copyPlane(unsigned char* to, int pitch, const unsigned char* from,
+                            int width, int height) {
+    if (pitch == width) {
+      memcpy(to, from, size_t(width) * height);
+    }
+    else {
+      for (int row=0; row < height; ++row)
+        memcpy(to + row * pitch, from + row * width, width);
+    }
+    return uint64_t(width) * height;
+  }
+
+  // Copies one band of a plane's rows per part
+  class CopyJob : public WorkerPool::Job {
+  public:
+    CopyJob(unsigned char* to, int pitch, const unsigned char* from, int width, int height,
+            int bands)
+      : mTo(to), mPitch(pitch), mFrom(from), mWidth(width), mHeight(height), mBands(bands) { }
+
+    void run(int part) {
+      int begin = mHeight * part / mBands, end = mHeight * (part + 1) / mBands;
+      copyPlane(mTo + begin * mPitch, mPitch, mFrom + begin * mWidth, mWidth, end - begin);
+    }
+
+  private:
+    unsigned char* mTo;
+    int mPitch;
+    const unsigned char* mFrom;
+    int mWidth;
+    int mHeight;
+    int mBands;
+  };
+
+  static void lock(SDL_Surface* surface) {
+    if (SDL_MUSTLOCK(surface)) {
+      int r = SDL_LockSurface(surface);
+      assert(r == 0);
+    }
+  }
+
+  static void unlock(SDL_Surface* surface) {
+    if (SDL_MUSTLOCK(surface))
+      SDL_UnlockSurface(surface);
+  }
+
+  shared_ptr<SDL_Surface>& mScreen;
+
+  int mWidth;
+  int mHeight;
+  int mUVWidth;
+  int mUVHeight;
+
+  shared_ptr<SDL_Overlay> mOverlays[2];
+  int mNextOverlay;
+  // Overlay holding the prepared frame, if it went to one
+  SDL_Overlay* mReady;
+  bool mPrepared;
+  shared_ptr<SDL_Surface> mRGB;
+
+  FrameScaler mScaler;
+
+  SubtitleCache mSubtitles;
+  // Time to convert, or upload, and blend subtitles onto frames without
+  // and with subtitles showing
+  Histogram mFrameUs[2];
+
+  long mResizes;
+};
+
+// Process the video data provided by liboggplay, preparing it to be shown by
+// Presenter::flip().
+void handle_video_data(Presenter& presenter,
+                       shared_ptr<Track> video, 
+                       OggPlayDataHeader* header) {
+  StageTimer timer(Stats::VIDEO_FRAME);
+  gStats.count(Stats::VIDEO_FRAMES);
+  presenter.prepareYUV(video, oggplay_callback_info_get_video_data(header));
+}
+
+// Process a subtitle bitmap rendered for showing over YUV video.
+void handle_subtitle_data(Presenter& presenter, OggPlayDataHeader* header) {
+  presenter.updateSubtitles(oggplay_callback_info_get_overlay_data(header));
+}
+
+// Process the RGB(A) video data provided by liboggplay.
+void handle_overlay_data(Presenter& presenter,
+                         OggPlayDataHeader* header) {
+  presenter.prepareRGB(oggplay_callback_info_get_overlay_data(header));
+}
+
+// Process the text from a Kate stream (when not already overlaid on video).
+void handle_text_data( shared_ptr<KateTrack> kate, 
+                       OggPlayTextData* header) {
+  cout << (const char*)header << endl;
+}
+
+// Handle key events. Return 'false' to exit the
+// play loop.
+bool handle_key_press(shared_ptr<SDL_Surface> screen, SDL_Event const& event) {
+  if (event.key.keysym.sym == SDLK_ESCAPE)
+    return false;
+  else if(event.key.keysym.sym == SDLK_SPACE) 
+    SDL_WM_ToggleFullScreen(screen.get());
+
+  return true;
+}
+
+// Handle any SDL events. Returning 'false' will
+// exit the play loop.
+bool handle_sdl_event(shared_ptr<SDL_Surface> screen, SDL_Event const& event) {
+  switch (event.type) {
+    case SDL_KEYDOWN:
+      return handle_key_press(screen, event);
+    case SDL_QUIT:
+      // Application window was closed.
+      return false;
+    default:
+      return true;
+  }
+}
+
+// The clock that video frames are presented against. When there is an audio
+// stream, media time is derived from how much audio the device has actually
+// played, so video follows what is heard. Without audio, or before the
+// device has started playing, the system clock is used. The difference
+// between the two clocks is tracked so drift can be reported.
+class MasterClock {
+public:
+  MasterClock()
+    : mOutput(0),
+      mBytesPerSecond(0),
+      mBaseMs(-1),
+      mAudioBaseMs(-1),
+      mAudioBaseBytes(0),
+      mQueuedBytes(0),
+      mLastAudioMs(-1),
+      mDriftSamples(0),
+      mDriftTotalMs(0),
+      mMaxDriftMs(0),
+      mLastDriftMs(0),
+      mAudioReadings(0),
+      mSystemReadings(0)
+  {
+  }
+
+  // Use the playback position of 'sound' as the master clock. 'output' is
+  // the thread writing to it.
+  void setAudio(shared_ptr<sa_stream_t> sound, AudioOutput* output, int rate, int channels) {
+    mSound = sound;
+    mOutput = output;
+    mBytesPerSecond = static_cast<int64_t>(rate) * channels * sizeof(short);
+  }
+
+  // Forget the current media time, e.g. after a seek. The clock restarts
+  // from the time of the next audio or video data.
+  void restart() {
+    mBaseMs = -1;
+    mAudioBaseMs = -1;
+    mLastAudioMs = -1;
+  }
+
+  // Start the system clock at media time 'ms' if it isn't already running.
+  void startAt(int64_t ms) {
+    if (mBaseMs == -1) {
+      mBaseMs = ms;
+      mStart = microsec_clock::universal_time();
+    }
+  }
+
+  // Record that 'bytes' of audio starting at media time 'ms' have been
+  // queued for the audio thread. Main thread only.
+  void audioQueued(int64_t ms, size_t bytes) {
+    startAt(ms);
+    if (mAudioBaseMs == -1) {
+      mAudioBaseMs = ms;
+      mAudioBaseBytes = mQueuedBytes;
+    }
+    mQueuedBytes += bytes;
+  }
+
+  // Queued audio that hadn't been written to the device yet was discarded.
+  void audioFlushed() {
+    if (mOutput)
+      mQueuedBytes = mOutput->writtenBytes();
+  }
+
+  // Current media time in milliseconds.
+  int64_t time() {
+    ptime now(microsec_clock::universal_time());
+    int64_t system_ms = mBaseMs + (now - mStart).total_milliseconds();
+    int64_t audio_ms;
+    if (audioTime(audio_ms)) {
+      recordDrift(audio_ms - system_ms);
+      mLastAudioMs = audio_ms;
+      mLastAudioTime = now;
+      ++mAudioReadings;
+      return audio_ms;
+    }
+
+    ++mSystemReadings;
+    // The device has played everything we've written. Carry on from the last
+    // audio position rather than jumping back to the system clock.
+    if (mLastAudioMs != -1)
+      return mLastAudioMs + (now - mLastAudioTime).total_milliseconds();
+    return system_ms;
+  }
+
+  void report() const {
+    cout << "A/V sync: " << mAudioReadings << " audio clock readings, "
+         << mSystemReadings << " system clock readings" << endl;
+    if (mDriftSamples > 0) {
+      cout << "  audio vs system clock drift: last " << mLastDriftMs
+           << " ms, mean " << (mDriftTotalMs / mDriftSamples)
+           << " ms, max " << mMaxDriftMs << " ms" << endl;
+    }
+  }
+
+private:
+  bool audioTime(int64_t& ms) {
+    if (!mSound || !mOutput || mAudioBaseMs == -1 || mBytesPerSecond == 0)
+      return false;
+
+    int64_t played = 0;
+    if (sa_stream_get_position(mSound.get(), SA_POSITION_WRITE_SOFTWARE, &played) != SA_SUCCESS)
+      return false;
+
+    // Still playing audio from before a seek, or nothing left to play
+    if (played < mAudioBaseBytes || played >= mOutput->writtenBytes())
+      return false;
+
+    ms = mAudioBaseMs + (played - mAudioBaseBytes) * 1000 / mBytesPerSecond;
+    return true;
+  }
+
+  void recordDrift(int64_t drift) {
+    mLastDriftMs = drift;
+    mDriftTotalMs += drift;
+    ++mDriftSamples;
+    if (drift > mMaxDriftMs || -drift > mMaxDriftMs)
+      mMaxDriftMs = drift < 0 ? -drift : drift;
+  }
+
+  shared_ptr<sa_stream_t> mSound;
+  AudioOutput* mOutput;
+  int64_t mBytesPerSecond;
+
+  // System clock: media time 'mBaseMs' at 'mStart'
+  int64_t mBaseMs;
+  ptime mStart;
+
+  // Audio clock: media time 'mAudioBaseMs' when 'mAudioBaseBytes' have been
+  // played by the device. Bytes are counted in the order they were queued,
+  // which is the order the audio thread writes them.
+  int64_t mAudioBaseMs;
+  int64_t mAudioBaseBytes;
+  int64_t mQueuedBytes;
+
+  int64_t mLastAudioMs;
+  ptime mLastAudioTime;
+
+  long mDriftSamples;
+  int64_t mDriftTotalMs;
+  int64_t mMaxDriftMs;
+  int64_t mLastDriftMs;
+  long mAudioReadings;
+  long mSystemReadings;
+};
+
+// What to do with video frames that are already late when they come out of
+// the buffer.
+enum FrameDropMode {
+  // Always present every frame
+  DROP_NEVER,
+  // Skip conversion and display of frames that are too late to show
+  DROP_LATE,
+  // As DROP_LATE, and when far behind seek forward to the clock's position
+  // so decoding resumes from the next keyframe instead of working through
+  // the backlog.
+  DROP_CATCHUP
+};
+
+struct FrameDropPolicy {
+  FrameDropPolicy()
+    : mode(DROP_LATE),
+      lateMs(50),
+      catchupMs(1000),
+      maxGapMs(500)
+  {
+  }
+
+  FrameDropMode mode;
+
+  // Frames later than this are dropped
+  long lateMs;
+
+  // In DROP_CATCHUP mode, being this late triggers a seek
+  long catchupMs;
+
+  // Present a frame regardless if none has been shown for this long, so a
+  // machine that can never keep up still shows something.
+  long maxGapMs;
+};
+
+FrameDropPolicy gFrameDropPolicy;
+
+// Applies the frame drop policy and keeps statistics on what happened to
+// each video frame.
+class FrameDropper {
+public:
+  FrameDropper(const FrameDropPolicy& policy)
+    : mPolicy(policy),
+      mLastPresentedMs(-1),
+      mPresented(0),
+      mDropped(0),
+      mCatchups(0),
+      mWorstLatenessMs(0)
+  {
+  }
+
+  // Returns true if the frame at media time 'frameMs', which is 'latenessMs'
+  // behind the master clock, should be converted and displayed.
+  bool shouldPresent(long frameMs, long latenessMs) {
+    mWorstLatenessMs = max(mWorstLatenessMs, latenessMs);
+    if (mPolicy.mode == DROP_NEVER ||
+        latenessMs <= mPolicy.lateMs ||
+        mLastPresentedMs == -1 ||
+        frameMs - mLastPresentedMs >= mPolicy.maxGapMs ||
+        frameMs < mLastPresentedMs) {
+      mLastPresentedMs = frameMs;
+      ++mPresented;
+      return true;
+    }
+    ++mDropped;
+    return false;
+  }
+
+  // Returns true if playback is so far behind that we should seek forward
+  // to catch up.
+  bool shouldCatchUp(long latenessMs) {
+    if (mPolicy.mode != DROP_CATCHUP || latenessMs <= mPolicy.catchupMs)
+      return false;
+    ++mCatchups;
+    return true;
+  }
+
+  void report() const {
+    cout << "Video frames: " << mPresented << " presented, " << mDropped << " dropped, "
+         << mCatchups << " catch-up seeks, worst lateness " << mWorstLatenessMs << " ms" << endl;
+  }
+
+private:
+  const FrameDropPolicy& mPolicy;
+  long mLastPresentedMs;
+  long mPresented;
+  long mDropped;
+  long mCatchups;
+  long mWorstLatenessMs;
+};
+
+// Pass an event to the seek bar and then the general handlers. Returning
+// 'false' will exit the play loop.
+bool dispatch_event(SeekBar& seekBar, shared_ptr<SDL_Surface> screen, SDL_Event const& event) {
+  return seekBar.handleEvent(screen, event) || handle_sdl_event(screen, event);
+}
+
+// Defined with the readers below
+shared_ptr<OggPlay> open_player(const char* path);
+
+// Nearest neighbour shrink of a plane of 'width' x 'height' bytes into one
+// of 'toWidth' x 'toHeight' bytes.
+void shrink_plane(const unsigned char* plane, int width, int height,
+                  unsigned char* to, int toWidth, int toHeight) {
+  for (int row=0; row < toHeight; ++row) {
+    const unsigned char* from = plane + (row * height / toHeight) * width;
+    for (int x=0; x < toWidth; ++x)
+      *to++ = from[x * width / toWidth];
+  }
+}
+
+// Makes the thumbnails for a ThumbnailCache in a background thread. It
+// decodes with a second player of its own on the same file, so playback
+// isn't disturbed by its seeks, and runs at a low priority with a pause
+// between thumbnails so that it doesn't compete with the decoder for CPU.
+// Only local files have thumbnails.
+class Thumbnailer {
+public:
+  // Width of the thumbnails in pixels
+  enum { WIDTH = 160 };
+
+  Thumbnailer(ThumbnailCache& cache)
+    : mCache(cache),
+      mThread(0),
+      mTrack(-1),
+      mIndex(0),
+      mDurationMs(-1)
+  {
+  }
+
+  ~Thumbnailer() {
+    stop();
+  }
+
+  // Start making thumbnails of video track 'track' of 'path'. Seeks use
+  // 'index' if it isn't null. 'durationMs' is the duration of the media,
+  // or -1 if it isn't known yet.
+  bool start(const string& path, int track, KeyframeIndex* index, int64_t durationMs) {
+    assert(!mThread);
+    if (path.compare(0, 7, "http://") == 0)
+      return false;
+    mPath = path;
+    mTrack = track;
+    mIndex = index;
+    mDurationMs = durationMs;
+    mThread = SDL_CreateThread(thumbnail_thread, this);
+    return mThread != 0;
+  }
+
+  void stop() {
+    if (!mThread)
+      return;
+    mCache.close();
+    SDL_WaitThread(mThread, NULL);
+    mThread = 0;
+  }
+
+private:
+  static int thumbnail_thread(void* data) {
+    static_cast<Thumbnailer*>(data)->run();
+    return 0;
+  }
+
+  void run() {
+#ifdef __linux__
+    // On Linux this applies to the calling thread only
+    setpriority(PRIO_PROCESS, 0, 10);
+#endif
+    shared_ptr<OggPlay> player(open_player(mPath.c_str()));
+    if (!player)
+      return;
+    oggplay_set_track_active(player.get(), mTrack);
+    oggplay_set_callback_num_frames(player.get(), mTrack, 1);
+    int r = oggplay_use_buffer(player.get(), 2);
+    assert(r == E_OGGPLAY_OK);
+
+    // The duration can only be asked for once frames have been decoded
+    int64_t start = now_us();
+    shared_ptr<Thumbnail> first(decodeFrame(player.get()));
+    if (!first)
+      return;
+    if (mDurationMs == -1)
+      mDurationMs = oggplay_get_duration(player.get());
+    mCache.setDuration(mDurationMs);
+    mCache.add(0, first, false, now_us() - start);
+
+    int64_t slot;
+    bool requested;
+    while (mCache.next(slot, requested)) {
+      start = now_us();
+      seek_player(player.get(), mIndex, mTrack, slot);
+      shared_ptr<Thumbnail> thumbnail(decodeFrame(player.get()));
+      if (!thumbnail) {
+        if (mCache.closed())
+          break;
+        mCache.ended(slot);
+        continue;
+      }
+      mCache.add(slot, thumbnail, requested, now_us() - start);
+      if (!requested)
+        SDL_Delay(20);
+    }
+  }
+
+  // Decodes up to the next video frame and returns a thumbnail of it, or a
+  // null pointer at the end of the media or when the cache is closed.
+  shared_ptr<Thumbnail> decodeFrame(OggPlay* player) {
+    while (!mCache.closed()) {
+      OggPlayCallbackInfo** info = oggplay_buffer_retrieve_next(player);
+      if (info) {
+        shared_ptr<Thumbnail> thumbnail;
+        if (oggplay_callback_info_get_type(info[mTrack]) == OGGPLAY_YUV_VIDEO &&
+            oggplay_callback_info_get_required(info[mTrack]) > 0) {
+          OggPlayDataHeader** headers = oggplay_callback_info_get_headers(info[mTrack]);
+          thumbnail = shrink(player, oggplay_callback_info_get_video_data(headers[0]));
+        }
+        oggplay_buffer_release(player, info);
+        if (thumbnail)
+          return thumbnail;
+        continue;
+      }
+
+      int r = oggplay_step_decoding(player);
+      if (r != E_OGGPLAY_CONTINUE && r != E_OGGPLAY_USER_INTERRUPT && r != E_OGGPLAY_TIMEOUT)
+        break;
+    }
+    return shared_ptr<Thumbnail>();
+  }
+
+  // Shrinks the planes of 'data' to thumbnail size, keeping the chroma
+  // subsampling, then converts them to RGB.
+  shared_ptr<Thumbnail> shrink(OggPlay* player, OggPlayVideoData* data) {
+    int y_width, y_height, uv_width, uv_height;
+    int r = oggplay_get_video_y_size(player, mTrack, &y_width, &y_height);
+    assert(r == E_OGGPLAY_OK);
+    r = oggplay_get_video_uv_size(player, mTrack, &uv_width, &uv_height);
+    assert(r == E_OGGPLAY_OK);
+
+    int width = min(int(WIDTH), y_width) & ~1;
+    int height = max(2, y_height * width / y_width) & ~1;
+    int small_uv_width = width * uv_width / y_width;
+    int small_uv_height = height * uv_height / y_height;
+
+    scoped_array<unsigned char> planes(new unsigned char[width * height + 2 * small_uv_width * small_uv_height]);
+    OggPlayYUVChannels yuv;
+    yuv.ptry = planes.get();
+    yuv.ptru = yuv.ptry + width * height;
+    yuv.ptrv = yuv.ptru + small_uv_width * small_uv_height;
+    yuv.y_width = width;
+    yuv.y_height = height;
+    yuv.uv_width = small_uv_width;
+    yuv.uv_height = small_uv_height;
+    shrink_plane(data->y, y_width, y_height, yuv.ptry, width, height);
+    shrink_plane(data->u, uv_width, uv_height, yuv.ptru, small_uv_width, small_uv_height);
+    shrink_plane(data->v, uv_width, uv_height, yuv.ptrv, small_uv_width, small_uv_height);
+
+    shared_ptr<Thumbnail> thumbnail(new Thumbnail(width, height));
+    gYUVConverter.convert(yuv, thumbnail->pixels.get(), width * 4);
+    return thumbnail;
+  }
+
+  ThumbnailCache& mCache;
+  SDL_Thread* mThread;
+  string mPath;
+  int mTrack;
+  KeyframeIndex* mIndex;
+  int64_t mDurationMs;
+};
+
+// What happened while playing a file
+struct PlayResult {
+  PlayResult() : videoFrames(0), audioSamples(0), firstFrameUs(-1), decodeResult(E_OGGPLAY_OK) { }
+
+  // Video frames and audio samples (per channel) taken from the buffer
+  long videoFrames;
+  int64_t audioSamples;
+
+  // Time from the start of playback to the first video frame being shown
+  int64_t firstFrameUs;
+
+  // See Decoder::result()
+  int decodeResult;
+};
+
+// Play the tracks. Exits when the longest track has completed playing.
+// 'report' prints the session's statistics at the end. 'info', if given,
+// supplies the duration and keyframe index, and the duration is filled in
+// if it wasn't known.
+PlayResult play(shared_ptr<OggPlay> player, shared_ptr<VorbisTrack> audio, shared_ptr<TheoraTrack> video,
+                shared_ptr<KateTrack> kate, bool report = true, MediaInfo* info = 0,
+                ThumbnailCache* thumbnails = 0) {
+  PlayResult result;
+  int64_t start_us = now_us();
+
+  // Video Surface. We delay creating it until we've decoded some of the
+  // video stream so we can get the width/height.
+  shared_ptr<SDL_Surface> screen;
+
+  // Open an audio stream
+  shared_ptr<sa_stream_t> sound(static_cast<sa_stream_t*>(NULL), sa_stream_destroy);
+
+  if (audio && !gSDL.fuzz_mode) {
+    sa_stream_t* s;
+    int sr = sa_stream_create_pcm(&s,
+                                  NULL,
+                                  SA_MODE_WRONLY,
+                                  SA_PCM_FORMAT_S16_NE,
+                                  audio->mRate,
+                                  audio->mChannels);
+    assert(sr == SA_SUCCESS);
+    sound.reset(s, sa_stream_destroy);
+
+    sr = sa_stream_open(sound.get());
+    //assert(sr == SA_SUCCESS);
+    if (sr != SA_SUCCESS) {
+      cerr << "Failed to open sound" << endl;
+    }
+  }
+
+  // Size the decode-ahead buffer for the tracks being played
+  size_t slot_bytes;
+  int64_t slot_period_us;
+  buffer_slot_size(video, audio, kate, slot_bytes, slot_period_us);
+  BufferSizer sizer(gBufferPolicy, slot_bytes, slot_period_us);
+
+  int r = oggplay_use_buffer(player.get(), sizer.maxDepth());
+  assert(r == E_OGGPLAY_OK);
+
+  // Event object for SDL
+  SDL_Event event;
+
+  // Audio is written to the device by a thread of its own
+  shared_ptr<AudioOutput> output;
+  if (sound) {
+    output.reset(new AudioOutput(sound, audio->mRate, audio->mChannels));
+    if (!output->start()) {
+      cerr << "Failed to start audio thread" << endl;
+      output.reset();
+    }
+  }
+
+  // Video frames are presented against this clock
+  MasterClock clock;
+  if (output && gSDL.audio_sync)
+    clock.setAudio(sound, output.get(), audio->mRate, audio->mChannels);
+
+  // Start the decoding loop in a background thread. The thread must
+  // be stopped before this function is exited so that the player
+  // object is not being used when it is deleted.
+  Decoder decoder(player);
+  // Files played without a report are decoded several at a time by --batch
+  decoder.shareStats(report);
+  decoder.setBufferSizer(&sizer);
+  if (info && info->useIndex && video)
+    decoder.setKeyframeIndex(&info->index, video->mIndex);
+
+  SeekBar seekBar(player, decoder, seconds(5), 10, 10, 1);
+  if (info && info->durationMs != -1)
+    seekBar.setEndTime(info->durationMs);
+  seekBar.setThumbnails(thumbnails);
+  long first_frame_time = -1;
+
+  // Conversion buffers reused across callbacks for the life of this session
+  BufferPool pool;
+
+  // Creates the screen once the first frame gives its size
+  Presenter presenter(screen);
+
+  // How long after their presentation time frames that were decoded in time
+  // are flipped. The spread of this is the jitter conversion adds.
+  Histogram flip_lateness;
+
+  FrameDropper dropper(gFrameDropPolicy);
+
+  gBenchmark.start();
+  if (!decoder.start()) {
+    result.decodeResult = E_OGGPLAY_BAD_INPUT;
+    return result;
+  }
+
+  // Set after a seek until a frame has been shown, to measure the latency
+  bool seek_frame_pending = false;
+
+  bool quit = false;
+  while (!quit) {
+    while (SDL_PollEvent(&event) == 1) {
+      if (!dispatch_event(seekBar, screen, event)) {
+        decoder.setCompleted(true);
+        quit = true;
+        break;
+      }
+    }
+    if (quit)
+      break;
+
+    gStats.dumpIfRequested();
+
+    unsigned long posted = decoder.framesPosted();
+
+    // Nothing is returned while a seek is waiting or under way
+    bool seeking = false;
+    OggPlayCallbackInfo** info = decoder.retrieveBuffer(seeking);
+    if (!info) {
+      if (seeking) {
+        // Keep the seek bar showing where we're going
+        if (screen) {
+          seekBar.setCurrentTime(decoder.seekTarget());
+          seekBar.draw(screen);
+          SDL_Flip(screen.get());
+        }
+      }
+      else {
+        // Once the decoder has finished, stop when everything it buffered
+        // has been played.
+        if (decoder.isCompleted())
+          break;
+        gStats.count(Stats::BUFFERS_EMPTY);
+      }
+
+      // Nothing to present yet. Sleep until the decoder posts a frame, or
+      // there's input to handle, rather than spinning.
+      StageTimer timer(Stats::MAIN_WAIT);
+      if (screen && gSDL.hasVideo()) {
+        if (decoder.beginEventWait(posted)) {
+          int got = SDL_WaitEvent(&event);
+          decoder.endEventWait();
+          if (got == 1 && !dispatch_event(seekBar, screen, event)) {
+            decoder.setCompleted(true);
+            quit = true;
+          }
+        }
+      }
+      else {
+        decoder.waitForFrame(posted, 100);
+      }
+      continue;
+    }
+    gStats.count(Stats::BUFFERS_RETRIEVED);
+
+    if (decoder.justSeeked()) {
+      seek_frame_pending = true;
+      clock.restart();
+      if (output) {
+        output->flush();
+        clock.audioFlushed();
+      }
+    }
+
+    // Set when we're too far behind and should skip ahead once the current
+    // buffer has been released.
+    long catchup_ms = -1;
+
+    int num_tracks = oggplay_get_num_tracks(player.get());
+    assert(!audio || audio && audio->mIndex < num_tracks);
+    assert(!video || video && video->mIndex < num_tracks);
+    assert(!kate || kate && kate->mIndex < num_tracks);
+
+    if (audio && oggplay_callback_info_get_type(info[audio->mIndex]) == OGGPLAY_FLOATS_AUDIO) {
+      OggPlayDataHeader** headers = oggplay_callback_info_get_headers(info[audio->mIndex]);
+      int required = oggplay_callback_info_get_required(info[audio->mIndex]);
+      for (int i=0; i<required;++i) {
+        int size = oggplay_callback_info_get_record_size(headers[i]);
+        OggPlayAudioData* data = oggplay_callback_info_get_audio_data(headers[i]);
+        int count = size * audio->mChannels;
+        result.audioSamples += size;
+        if (output) {
+          clock.audioQueued(oggplay_callback_info_get_presentation_time(headers[i]),
+                            count * sizeof(short));
+          handle_audio_data(output.get(), pool, data, count);
+        }
+        else if (gBenchmark.enabled) {
+          handle_audio_data(0, pool, data, count);
+          gBenchmark.audioSamples += size;
+          gBenchmark.audioChannels = audio->mChannels;
+        }
+      }
+    }
+    
+    // Subtitles for the video frame in this buffer. Only the latest bitmap
+    // matters.
+    if (kate && video && oggplay_callback_info_get_type(info[kate->mIndex]) == OGGPLAY_RGBA_VIDEO) {
+      int required = oggplay_callback_info_get_required(info[kate->mIndex]);
+      if (required > 0) {
+        OggPlayDataHeader** headers = oggplay_callback_info_get_headers(info[kate->mIndex]);
+        handle_subtitle_data(presenter, headers[required - 1]);
+      }
+    }
+
+    if (video || kate) {
+      int idx = video ? video->mIndex : kate->mIndex;
+      int required = oggplay_callback_info_get_required(info[idx]);
+      if (required > 0) {
+        int type = oggplay_callback_info_get_type(info[idx]);
+        if (type == OGGPLAY_YUV_VIDEO || type == OGGPLAY_RGBA_VIDEO) {
+          OggPlayDataHeader** headers = oggplay_callback_info_get_headers(info[idx]);
+          long video_ms = oggplay_callback_info_get_presentation_time(headers[0]);
+
+          if (first_frame_time == -1) {
+            first_frame_time = video_ms;
+            seekBar.setStartTime(first_frame_time);
+          }
+          seekBar.setCurrentTime(video_ms);
+
+          clock.startAt(video_ms);
+          long now_ms = clock.time();
+          long diff = video_ms - now_ms;
+          int64_t deadline_us = now_us() + int64_t(diff) * 1000;
+          bool wait = diff > 0 && !gSDL.fuzz_mode;
+
+          if (wait && !gSDL.convert_ahead) {
+            // Need to pause for a bit until it's time for the video frame to appear
+            SDL_Delay(diff);
+          }
+
+          bool present = gSDL.fuzz_mode || dropper.shouldPresent(video_ms, -diff);
+          if (!gSDL.fuzz_mode && dropper.shouldCatchUp(-diff))
+            catchup_ms = now_ms;
+
+          // The presenter recreates its surfaces if the video changes size
+          shared_ptr<Track> track = video;
+          if (!track) track = kate;
+          ++result.videoFrames;
+          if (gBenchmark.enabled)
+            ++gBenchmark.videoFrames;
+
+          if (!present) {
+            // Too late to be worth showing
+          }
+          else if (type == OGGPLAY_YUV_VIDEO) {
+            handle_video_data(presenter, track, headers[0]);
+          }
+          else if (type == OGGPLAY_RGBA_VIDEO) {
+            printf("handle_overlay_data()\n");
+            handle_overlay_data(presenter, headers[0]);
+          }
+
+          if (wait && gSDL.convert_ahead) {
+            // The frame is ready, so pause for what's left until it's due
+            int64_t remaining_us = deadline_us - now_us();
+            if (remaining_us > 0)
+              SDL_Delay((remaining_us + 999) / 1000);
+          }
+          if (present) {
+            presenter.flip(seekBar);
+            if (wait)
+              flip_lateness.record(now_us() - deadline_us);
+          }
+          if (present && result.firstFrameUs == -1)
+            result.firstFrameUs = now_us() - start_us;
+          if (present && seek_frame_pending) {
+            decoder.seekPresented();
+            seek_frame_pending = false;
+          }
+        }
+      }
+    }
+
+    if (kate && oggplay_callback_info_get_type(info[kate->mIndex]) == OGGPLAY_KATE) {
+      OggPlayDataHeader** headers = oggplay_callback_info_get_headers(info[kate->mIndex]);
+      double time = oggplay_callback_info_get_presentation_time(headers[0]) / 1000.0;
+      int required = oggplay_callback_info_get_required(info[kate->mIndex]);
+      for (int i=0; i<required;++i) {
+        OggPlayTextData* data = oggplay_callback_info_get_text_data(headers[i]);
+        if (report)
+          handle_text_data(kate, data);
+      }
+    }
+    
+    {
+      StageTimer timer(Stats::BUFFER_RELEASE);
+      oggplay_buffer_release(player.get(), info);
+    }
+    decoder.bufferReleased();
+
+    if (catchup_ms != -1)
+      decoder.requestSeek(catchup_ms);
+  } 
+ 
+  // Find the duration for the cache if the seek bar didn't need it. It's
+  // only safe to ask once frames have been decoded, and before the player is
+  // prepared for closing. Benchmarks skip the scan so it isn't timed.
+  if (info && info->storing && info->durationMs == -1 && !gBenchmark.enabled) {
+    if (seekBar.endTime() != -1) {
+      info->durationMs = seekBar.endTime();
+      info->durationScanUs = seekBar.durationScanUs();
+    }
+    else if (first_frame_time != -1) {
+      int64_t scan_start = now_us();
+      info->durationMs = oggplay_get_duration(player.get());
+      info->durationScanUs = now_us() - scan_start;
+    }
+  }
+
+  // The decoding thread can be blocked in the call to oggplay_step_decoding.
+  // The following call will cause the thread blocked on that function to unblock
+  // and exit the decoding loop. We then join to the thread to ensure it has
+  // completed before we return so that player object can safely be deleted.
+  // A seek still running on the decode thread must finish first.
+  decoder.setCompleted(true);
+  decoder.waitForSeek();
+  oggplay_prepare_for_close(player.get());
+  decoder.stop();
+  result.decodeResult = decoder.result();
+
+  // Let the audio already queued play out, unless the user quit
+  if (output)
+    output->stop(!quit);
+
+  gBenchmark.end();
+
+  if (report) {
+    clock.report();
+    if (output)
+      output->report();
+    sizer.report(decoder.peakBuffered());
+    dropper.report();
+    gPresentation.report();
+    if (video)
+      presenter.report();
+    if (flip_lateness.count() > 0) {
+      cout << "Deadline to flip ("
+           << (gSDL.convert_ahead ? "converted ahead" : "converted at the deadline") << "): "
+           << flip_lateness.toString() << ", jitter (p99 - p50) "
+           << flip_lateness.percentile(0.99) - flip_lateness.percentile(0.5) << "us" << endl;
+    }
+    if (result.firstFrameUs != -1)
+      cout << "Time to first frame: " << result.firstFrameUs / 1000 << " ms" << endl;
+    if (info && info->useIndex)
+      info->index.report();
+    decoder.reportSeeks();
+    if (gBenchmark.enabled)
+      gBenchmark.report();
+
+    cout << "Buffer pool: " << pool.allocations() << " allocations for "
+         << pool.requests() << " requests, " << pool.bytesHeld() << " bytes held" << endl;
+  }
+  return result;
+}
+
+// Which OggPlayReader local files are read with
+enum ReaderKind {
+  // liboggplay's reader, which uses stdio
+  READER_FILE,
+  READER_MMAP
+};
+
+ReaderKind gReaderKind = READER_FILE;
+
+// OggPlayReader for local files that maps the whole file into memory, so
+// reads are copies from the page cache rather than read() calls, and seeks
+// only move the position. The kernel is told the file is read sequentially
+// and the pages ahead of the position are requested before they're needed.
+// liboggplay destroys it when the player is closed.
+class MmapReader : public OggPlayReader {
+public:
+  // Bytes ahead of the read position to prefetch, once RUN bytes have been
+  // read since the last seek. Seeks bisect the file with short reads at many
+  // places, which aren't worth prefetching after.
+  enum { PREFETCH = 4 * 1024 * 1024, RUN = 64 * 1024 };
+
+  static OggPlayReader* create(const char* path) {
+    return new MmapReader(path);
+  }
+
+private:
+  MmapReader(const char* path)
+    : mPath(path),
+      mFd(-1),
+      mData(0),
+      mSize(0),
+      mPosition(0),
+      mRunStart(0),
+      mPrefetched(0)
+  {
+    initialise = initialise_reader;
+    destroy = destroy_reader;
+    // Null makes liboggplay seek with oggz through io_seek/io_read
+    seek = 0;
+    available = available_bytes;
+    duration = unknown_duration;
+    finished_retrieving = all_retrieved;
+    io_read = read;
+    io_seek = seek_to;
+    io_tell = tell;
+  }
+
+  ~MmapReader() {
+    if (mData)
+      munmap(mData, mSize);
+    if (mFd != -1)
+      ::close(mFd);
+  }
+
+  static OggPlayErrorCode initialise_reader(OggPlayReader* reader, int) {
+    MmapReader* me = static_cast<MmapReader*>(reader);
+    me->mFd = open(me->mPath.c_str(), O_RDONLY);
+    struct stat st;
+    if (me->mFd == -1 || fstat(me->mFd, &st) != 0)
+      return E_OGGPLAY_BAD_INPUT;
+    me->mSize = st.st_size;
+    if (me->mSize == 0)
+      return E_OGGPLAY_OK;
+    void* data = mmap(0, me->mSize, PROT_READ, MAP_PRIVATE, me->mFd, 0);
+    if (data == MAP_FAILED)
+      return E_OGGPLAY_BAD_INPUT;
+    me->mData = static_cast<unsigned char*>(data);
+    madvise(data, me->mSize, MADV_SEQUENTIAL);
+    return E_OGGPLAY_OK;
+  }
+
+  static OggPlayErrorCode destroy_reader(OggPlayReader* reader) {
+    delete static_cast<MmapReader*>(reader);
+    return E_OGGPLAY_OK;
+  }
+
+  static int available_bytes(OggPlayReader* reader, ogg_int64_t, ogg_int64_t) {
+    // liboggplay takes an int, so files over 2GB report INT_MAX
+    return int(min(static_cast<MmapReader*>(reader)->mSize, size_t(INT_MAX)));
+  }
+
+  static ogg_int64_t unknown_duration(OggPlayReader*) {
+    return -1;
   }
-  
-  void setStartTime(int64_t timeMs) {
-    mStartTimeMs = timeMs;
+
+  static int all_retrieved(OggPlayReader*) {
+    return 1;
   }
-  
-  void draw(shared_ptr<SDL_Surface>& screen) {
-    if (!isVisible(screen) || !screen) {
+
+  static size_t read(void* handle, void* buf, size_t n) {
+    MmapReader* me = static_cast<MmapReader*>(static_cast<OggPlayReader*>(handle));
+    if (me->mPosition >= me->mSize)
+      return 0;
+    n = min(n, me->mSize - me->mPosition);
+    me->prefetch(me->mPosition + n);
+    memcpy(buf, me->mData + me->mPosition, n);
+    me->mPosition += n;
+    return n;
+  }
+
+  static int seek_to(void* handle, long offset, int whence) {
+    MmapReader* me = static_cast<MmapReader*>(static_cast<OggPlayReader*>(handle));
+    int64_t base = whence == SEEK_CUR ? me->mPosition : (whence == SEEK_END ? me->mSize : 0);
+    if (base + offset < 0 || base + offset > int64_t(me->mSize))
+      return -1;
+    me->mPosition = base + offset;
+    me->mRunStart = me->mPosition;
+    me->mPrefetched = me->mPosition;
+    return 0;
+  }
+
+  static long tell(void* handle) {
+    return static_cast<MmapReader*>(static_cast<OggPlayReader*>(handle))->mPosition;
+  }
+
+  // Keep at least half of PREFETCH bytes past 'end' requested from the kernel
+  void prefetch(size_t end) {
+    if (mPrefetched >= mSize || end + PREFETCH / 2 <= mPrefetched || end - mRunStart < RUN)
       return;
+    static const size_t page = sysconf(_SC_PAGESIZE);
+    size_t from = max(mPrefetched, mPosition) & ~(page - 1);
+    size_t to = min(mSize, end + size_t(PREFETCH));
+    madvise(mData + from, to - from, MADV_WILLNEED);
+    mPrefetched = to;
+  }
+
+  string mPath;
+  int mFd;
+  unsigned char* mData;
+  size_t mSize;
+  size_t mPosition;
+
+  // Position of the last seek
+  size_t mRunStart;
+
+  // End of the range requested with MADV_WILLNEED
+  size_t mPrefetched;
+};
+
+// Megabytes of disk the HTTP reader may cache a stream in
+size_t gHttpCacheMB = 256;
+
+// OggPlayReader for http:// URLs. A background thread fetches the stream
+// with HTTP range requests, up to READAHEAD blocks of BLOCK bytes ahead of
+// the read position, into a cache file of at most gHttpCacheMB. Reads are
+// served from the cache file and only wait for the fetcher when their part
+// of the block hasn't arrived, so seeking back to a part of the stream
+// that was already fetched doesn't touch the network. Seeking elsewhere
+// abandons the current request for one starting at the new position. The
+// least recently read blocks are dropped when the cache is full. The cache
+// file is unlinked once it's open, so it goes away with the reader.
+class HttpReader : public OggPlayReader {
+public:
+  enum {
+    BLOCK = 256 * 1024,
+    READAHEAD = 16,
+    // Seconds without data before a request is given up
+    TIMEOUT = 15,
+    // Failed requests in a row before the stream is treated as ended
+    RETRIES = 3
+  };
+
+  // Returns a null pointer if 'url' can't be parsed
+  static OggPlayReader* create(const char* url) {
+    string host, port, path;
+    if (!parse_url(url, host, port, path))
+      return 0;
+    return new HttpReader(host, port, path);
+  }
+
+  static bool parse_url(const string& url, string& host, string& port, string& path) {
+    if (url.compare(0, 7, "http://") != 0)
+      return false;
+    size_t slash = url.find('/', 7);
+    string authority = url.substr(7, slash == string::npos ? string::npos : slash - 7);
+    path = slash == string::npos ? "/" : url.substr(slash);
+    size_t colon = authority.rfind(':');
+    host = authority.substr(0, colon);
+    port = colon == string::npos ? "80" : authority.substr(colon + 1);
+    return !host.empty() && !port.empty();
+  }
+
+private:
+  HttpReader(const string& host, const string& port, const string& path)
+    : mHost(host),
+      mPort(port),
+      mPath(path),
+      mLock(SDL_CreateMutex()),
+      mArrived(SDL_CreateCond()),
+      mWanted(SDL_CreateCond()),
+      mThread(0),
+      mStopping(false),
+      mAddresses(0),
+      mCacheFd(-1),
+      mSize(-1),
+      mStarted(false),
+      mFailed(false),
+      mPosition(0),
+      mWantBlock(0),
+      mTick(0),
+      mBytesFetched(0),
+      mRequests(0),
+      mAbandoned(0),
+      mHits(0),
+      mStalls(0),
+      mStallUs(0),
+      mEvictions(0)
+  {
+    initialise = initialise_reader;
+    destroy = destroy_reader;
+    // Null makes liboggplay seek with oggz through io_seek/io_read
+    seek = 0;
+    available = available_bytes;
+    duration = unknown_duration;
+    finished_retrieving = all_retrieved;
+    io_read = read;
+    io_seek = seek_to;
+    io_tell = tell;
+
+    size_t slots = max(size_t(2 * READAHEAD), gHttpCacheMB * 1024 * 1024 / BLOCK);
+    mSlots.resize(slots);
+  }
+
+  ~HttpReader() {
+    stop();
+    if (mCacheFd != -1)
+      ::close(mCacheFd);
+    if (mAddresses)
+      freeaddrinfo(mAddresses);
+    SDL_DestroyCond(mWanted);
+    SDL_DestroyCond(mArrived);
+    SDL_DestroyMutex(mLock);
+  }
+
+  // A block of the stream held in the cache file
+  struct Slot {
+    Slot() : block(-1), filled(0), used(0) { }
+    int64_t block;
+    // Bytes of the block that have arrived
+    int filled;
+    // Value of mTick when last read, for eviction
+    unsigned long used;
+  };
+
+  static OggPlayErrorCode initialise_reader(OggPlayReader* reader, int) {
+    HttpReader* me = static_cast<HttpReader*>(reader);
+    string dir = cache_directory();
+    if (dir.empty())
+      dir = "/tmp";
+    else
+      make_cache_directory(dir);
+    string name = dir + "/http-XXXXXX";
+    vector<char> temp(name.begin(), name.end());
+    temp.push_back(0);
+    me->mCacheFd = mkstemp(&temp[0]);
+    if (me->mCacheFd == -1)
+      return E_OGGPLAY_BAD_INPUT;
+    unlink(&temp[0]);
+
+    me->mThread = SDL_CreateThread(fetch_thread, me);
+    if (!me->mThread)
+      return E_OGGPLAY_BAD_INPUT;
+
+    // Wait for the first response, which tells us the size of the stream
+    SDL_LockMutex(me->mLock);
+    while (!me->mStarted && !me->mFailed)
+      SDL_CondWait(me->mArrived, me->mLock);
+    bool ok = me->mStarted;
+    SDL_UnlockMutex(me->mLock);
+    return ok ? E_OGGPLAY_OK : E_OGGPLAY_BAD_INPUT;
+  }
+
+  static OggPlayErrorCode destroy_reader(OggPlayReader* reader) {
+    HttpReader* me = static_cast<HttpReader*>(reader);
+    me->stop();
+    me->report();
+    delete me;
+    return E_OGGPLAY_OK;
+  }
+
+  static int available_bytes(OggPlayReader* reader, ogg_int64_t, ogg_int64_t) {
+    HttpReader* me = static_cast<HttpReader*>(reader);
+    SDL_LockMutex(me->mLock);
+    int64_t size = me->mSize;
+    SDL_UnlockMutex(me->mLock);
+    // liboggplay takes an int, so streams over 2GB report INT_MAX
+    return int(min(size, int64_t(INT_MAX)));
+  }
+
+  static ogg_int64_t unknown_duration(OggPlayReader*) {
+    return -1;
+  }
+
+  // Reads block until their data arrives, so everything has been retrieved
+  // by the time liboggplay sees the end of the stream.
+  static int all_retrieved(OggPlayReader*) {
+    return 1;
+  }
+
+  static size_t read(void* handle, void* buf, size_t n) {
+    HttpReader* me = static_cast<HttpReader*>(static_cast<OggPlayReader*>(handle));
+    int64_t block = me->mPosition / BLOCK;
+    int offset = me->mPosition % BLOCK;
+
+    SDL_LockMutex(me->mLock);
+    if (me->mSize != -1 && me->mPosition >= me->mSize) {
+      SDL_UnlockMutex(me->mLock);
+      return 0;
     }
-    
-    SDL_Rect border = getBorderRect(screen);
-    unsigned white = SDL_MapRGB(screen->format, 255, 255, 255);
-    int err = SDL_FillRect(screen.get(), &border, white);
-    assert(err == 0);
-    
-    SDL_Rect background = getBackgroundRect(screen);
-    unsigned black = SDL_MapRGB(screen->format, 0, 0, 0);
-    err = SDL_FillRect(screen.get(), &background, black);
-    assert(err == 0);
-    
-    SDL_Rect progress = getProgressRect(screen);
-    unsigned gray = SDL_MapRGB(screen->format, 0xd6, 0xd6, 0xd6);
-    err = SDL_FillRect(screen.get(), &progress, gray);
-    
-    assert(err == 0);
+    me->want(block);
+    Slot* slot = me->find(block);
+    int64_t stall_start = 0;
+    while (!(slot && slot->filled > offset) && !me->mFailed &&
+           !(me->mSize != -1 && me->mPosition >= me->mSize)) {
+      if (!stall_start)
+        stall_start = now_us();
+      SDL_CondWait(me->mArrived, me->mLock);
+      slot = me->find(block);
+    }
+    if (stall_start) {
+      ++me->mStalls;
+      me->mStallUs += now_us() - stall_start;
+    }
+    else {
+      ++me->mHits;
+    }
+    if (!(slot && slot->filled > offset)) {
+      SDL_UnlockMutex(me->mLock);
+      return 0;
+    }
+    n = min(n, size_t(slot->filled - offset));
+    slot->used = ++me->mTick;
+    off_t at = off_t(slot - &me->mSlots[0]) * BLOCK + offset;
+    SDL_UnlockMutex(me->mLock);
+
+    // The block can't be evicted while it's the one wanted
+    ssize_t got = pread(me->mCacheFd, buf, n, at);
+    if (got <= 0)
+      return 0;
+    me->mPosition += got;
+    return got;
   }
-  
-  // Returns true if handles/consumes the event, otherwise false.
-  bool handleEvent(shared_ptr<SDL_Surface> screen, SDL_Event const& event) {
-    if (event.type == SDL_MOUSEMOTION) {
-      updateHideTime();
-      return true;
-    } else if (event.type == SDL_MOUSEBUTTONDOWN &&
-               event.button.button == SDL_BUTTON_LEFT) {
-      int x = event.button.x;
-      int y = event.button.y;
-      SDL_Rect background = getBackgroundRect(screen);
-      SDL_Rect progress = getProgressRect(screen);
-      if (isInside(x, y, background)) {
-        double progressWidth = background.w - 2 * mBorder;
-        double proportion = (x - progress.x) / progressWidth;
-        double duration = mEndTimeMs - mStartTimeMs;
-        double seekTime = duration * proportion;
-        int64_t seekTimeMs = mStartTimeMs + (int64_t)seekTime;
-        mDecoder.seek(seekTimeMs);
-        return true;
+
+  static int seek_to(void* handle, long offset, int whence) {
+    HttpReader* me = static_cast<HttpReader*>(static_cast<OggPlayReader*>(handle));
+    SDL_LockMutex(me->mLock);
+    int64_t base = whence == SEEK_CUR ? me->mPosition : (whence == SEEK_END ? me->mSize : 0);
+    bool ok = base != -1 && base + offset >= 0 && (me->mSize == -1 || base + offset <= me->mSize);
+    if (ok) {
+      me->mPosition = base + offset;
+      me->want(me->mPosition / BLOCK);
+      // Give a stream that failed another chance from the new position
+      if (me->mFailed) {
+        me->mFailed = false;
+        SDL_CondSignal(me->mWanted);
       }
-      return false;
     }
-    return false;
-  }  
-  
-private:
+    SDL_UnlockMutex(me->mLock);
+    return ok ? 0 : -1;
+  }
 
-  SDL_Rect getBorderRect(shared_ptr<SDL_Surface> screen) {
-    SDL_Rect border;
-    border.x = mPadding;
-    border.y = screen->h - mPadding - mHeight;
-    border.w = screen->w - mPadding * 2;
-    border.h = mHeight;
-    return border;
+  static long tell(void* handle) {
+    return static_cast<HttpReader*>(static_cast<OggPlayReader*>(handle))->mPosition;
   }
 
-  SDL_Rect getBackgroundRect(shared_ptr<SDL_Surface> screen) {
-    SDL_Rect background;
-    background.x = mPadding + mBorder;
-    background.y = screen->h - mPadding - mHeight + mBorder;
-    background.w = screen->w - 2 * mPadding - 2 * mBorder;
-    background.h = mHeight - 2 * mBorder;
-    return background;
+  static int fetch_thread(void* data) {
+    static_cast<HttpReader*>(data)->run();
+    return 0;
   }
 
-  SDL_Rect getProgressRect(shared_ptr<SDL_Surface> screen) {
-    if (mEndTimeMs == -1) {
-      // Due to a bug in liboggplay, we can't call this before the frames
-      // start coming in, else we'll sometimes deadlock on some files.
-      mEndTimeMs = oggplay_get_duration(mPlayer.get());
+  void stop() {
+    if (!mThread)
+      return;
+    SDL_LockMutex(mLock);
+    mStopping = true;
+    SDL_CondBroadcast(mWanted);
+    SDL_UnlockMutex(mLock);
+    SDL_WaitThread(mThread, NULL);
+    mThread = 0;
+  }
+
+  // Called with the lock held
+  void want(int64_t block) {
+    if (block != mWantBlock) {
+      mWantBlock = block;
+      SDL_CondSignal(mWanted);
     }
-    double duration = mEndTimeMs - mStartTimeMs;
-    double position = mCurrentTimeMs - mStartTimeMs;
-    SDL_Rect background = getBackgroundRect(screen);
-    double maxWidth = background.w - 2 * mBorder;
-    SDL_Rect progress;
-    progress.x = background.x + mBorder;
-    progress.y = background.y + mBorder;
-    progress.h = background.h - 2 * mBorder;
-    progress.w = max(1, (int)(maxWidth * position / duration));
-    return progress;
   }
 
-  bool isInside(int x, int y, const SDL_Rect& rect) {
-    return x > rect.x &&
-           x < rect.x + rect.w &&
-           y > rect.y &&
-           y < rect.y + rect.h;
+  // Called with the lock held
+  Slot* find(int64_t block) {
+    map<int64_t, size_t>::iterator it = mBlocks.find(block);
+    return it == mBlocks.end() ? 0 : &mSlots[it->second];
   }
 
-  bool isVisible(shared_ptr<SDL_Surface> screen) {
-    int x=0, y=0;
-    SDL_GetMouseState(&x, &y);
-    SDL_Rect background = getBackgroundRect(screen);
-    return second_clock::local_time() < mHideTime ||
-           isInside(x, y, background);
+  // Bytes in 'block'. Called with the lock held.
+  int blockLength(int64_t block) const {
+    if (mSize == -1)
+      return BLOCK;
+    return int(min(int64_t(BLOCK), max(int64_t(0), mSize - block * BLOCK)));
   }
 
-  void updateHideTime() {
-    mHideTime = second_clock::local_time() + mVisibleDuration;
+  // Called with the lock held
+  bool complete(int64_t block) {
+    Slot* slot = find(block);
+    return slot && slot->filled == blockLength(block);
   }
 
-  shared_ptr<OggPlay> mPlayer;
-  Decoder& mDecoder;
+  // Whether 'block' is in the read ahead window. Called with the lock held.
+  bool inWindow(int64_t block) const {
+    return block >= mWantBlock && block < mWantBlock + READAHEAD &&
+           (mSize == -1 || block * BLOCK < mSize);
+  }
 
-  int64_t mStartTimeMs;
-  int64_t mEndTimeMs;
-  int64_t mCurrentTimeMs;
+  // Finds a slot for 'block', evicting the least recently read block
+  // outside the read ahead window if the cache is full. A block that's
+  // already cached keeps what has arrived of it. Called with the lock held.
+  Slot* allocate(int64_t block) {
+    Slot* slot = find(block);
+    if (!slot) {
+      size_t victim = mSlots.size();
+      for (size_t i=0; i < mSlots.size(); ++i) {
+        if (mSlots[i].block == -1) {
+          victim = i;
+          break;
+        }
+        if (!inWindow(mSlots[i].block) &&
+            (victim == mSlots.size() || mSlots[i].used < mSlots[victim].used))
+          victim = i;
+      }
+      assert(victim < mSlots.size());
+      slot = &mSlots[victim];
+      if (slot->block != -1) {
+        mBlocks.erase(slot->block);
+        ++mEvictions;
+      }
+      slot->block = block;
+      slot->filled = 0;
+      mBlocks[block] = victim;
+    }
+    slot->used = mTick;
+    return slot;
+  }
 
-  // Height of the seek bar, in pixels, including borders, background,
-  // and progress bar.
-  int mHeight;
-  
-  // Number of pixels between bottom and sides of screen and the seek bar.
-  int mPadding;
-  
-  // Thickness of borders in pixels.
-  int mBorder;
-  
-  ptime mHideTime;
-  time_duration mVisibleDuration;
-  
-};
+  void run() {
+    int failures = 0;
+    SDL_LockMutex(mLock);
+    while (!mStopping) {
+      // A failed stream waits for a seek to try again
+      if (mFailed) {
+        failures = 0;
+        SDL_CondWait(mWanted, mLock);
+        continue;
+      }
 
-// Process the audio data provided by liboggplay. 'count' is the number of
-// floats contained within 'data'.
-void handle_audio_data(shared_ptr<sa_stream_t> sound, OggPlayAudioData* data, int count) {
-  // Convert float data to S16 LE
-  scoped_array<short> dest(new short[count]);
-  float* source = reinterpret_cast<float*>(data);
-  for (int i=0; i < count; ++i) {
-    float scaled = floorf(0.5 + 32768 * source[i]);
-    if (source[i] < 0.0)
-      dest[i] = scaled < -32768.0 ? -32768 : static_cast<short>(scaled);
-    else
-      dest[i] = scaled > 32767.0 ? 32767 : static_cast<short>(scaled);
+      // Fetch when the block being read is missing or half the read ahead
+      // window is, so that each request is worth making, or when the
+      // window reaches the end of the stream
+      int64_t first = -1;
+      int missing = 0;
+      for (int64_t b = mWantBlock; mStarted ? inWindow(b) : b == mWantBlock; ++b) {
+        if (!complete(b)) {
+          if (first == -1)
+            first = b;
+          ++missing;
+        }
+      }
+      bool to_end = mSize != -1 && (mWantBlock + READAHEAD) * BLOCK >= mSize;
+      if (first == -1 || (first != mWantBlock && missing < READAHEAD / 2 && !to_end)) {
+        SDL_CondWait(mWanted, mLock);
+        continue;
+      }
+      int64_t end = (mWantBlock + READAHEAD) * BLOCK;
+      if (mSize != -1)
+        end = min(end, mSize);
+      // Carry on from where a response that ended early stopped
+      Slot* slot = find(first);
+      int64_t begin = first * BLOCK + (slot ? slot->filled : 0);
+      int64_t fetched = mBytesFetched;
+      ++mRequests;
+      SDL_UnlockMutex(mLock);
+
+      bool ok = fetch(begin, end);
+
+      SDL_LockMutex(mLock);
+      // Only requests that got nothing count towards giving up
+      failures = mBytesFetched > fetched ? 0 : failures + 1;
+      if (failures == RETRIES || (!ok && !mStarted)) {
+        mFailed = true;
+        SDL_CondBroadcast(mArrived);
+      }
+    }
+    SDL_UnlockMutex(mLock);
   }
 
-  int sr = sa_stream_write(sound.get(), dest.get(), count * sizeof(short));
-  assert(sr == SA_SUCCESS);
-}
+  // Fetches the bytes from 'begin' to 'end', or to the end of the stream if
+  // 'end' is -1. Returns false if the request failed.
+  bool fetch(int64_t begin, int64_t end) {
+    int fd = connectToServer();
+    if (fd == -1)
+      return false;
 
-// Process the video data provided by liboggplay. Currently using liboggplay's
-// yuv2rgb routines to test the speed. I'll later provide a switch to use
-// SDL's routines to compare.
-void handle_video_data(shared_ptr<SDL_Surface>& screen, 
-                       SeekBar& seekBar,
-                       shared_ptr<Track> video, 
-                       OggPlayDataHeader* header) {
-  shared_ptr<OggPlay> player(video->mPlayer);
-  int y_width, y_height;
-  int r = oggplay_get_video_y_size(player.get(), video->mIndex, &y_width, &y_height);
-  assert(r == E_OGGPLAY_OK);
+    // Wake up every second to notice seeks and stop requests
+    timeval second;
+    second.tv_sec = 1;
+    second.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &second, sizeof(second));
+
+    ostringstream request;
+    request << "GET " << mPath << " HTTP/1.1\r\n"
+            << "Host: " << mHost << "\r\n"
+            << "Range: bytes=" << begin << '-';
+    if (end != -1)
+      request << end - 1;
+    request << "\r\nConnection: close\r\n\r\n";
+    string text = request.str();
+    bool ok = send(fd, text.data(), text.size(), MSG_NOSIGNAL) == ssize_t(text.size()) &&
+              receive(fd, begin, end);
+    ::close(fd);
+    return ok;
+  }
 
-  int uv_width, uv_height;
-  r = oggplay_get_video_uv_size(player.get(), video->mIndex, &uv_width, &uv_height);
-  assert(r == E_OGGPLAY_OK);
+  // Returns a socket connected to the server, or -1. The server's name is
+  // looked up by the first request, while the stream is being opened, and
+  // kept so that stop() never waits for a lookup. Connecting gives up after
+  // TIMEOUT seconds or when stopping.
+  int connectToServer() {
+    if (!mAddresses) {
+      addrinfo hints;
+      memset(&hints, 0, sizeof(hints));
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      if (getaddrinfo(mHost.c_str(), mPort.c_str(), &hints, &mAddresses) != 0) {
+        mAddresses = 0;
+        return -1;
+      }
+    }
+    for (addrinfo* a = mAddresses; a; a = a->ai_next) {
+      int fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+      if (fd == -1)
+        continue;
+      if (connectTo(fd, a))
+        return fd;
+      ::close(fd);
+    }
+    return -1;
+  }
+
+  bool connectTo(int fd, const addrinfo* address) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+      return false;
+    bool connected = connect(fd, address->ai_addr, address->ai_addrlen) == 0;
+    if (!connected && errno == EINPROGRESS) {
+      for (int idle=0; idle < TIMEOUT && !stopping(); ++idle) {
+        pollfd writable;
+        writable.fd = fd;
+        writable.events = POLLOUT;
+        writable.revents = 0;
+        int ready = poll(&writable, 1, 1000);
+        if (ready == 0 || (ready == -1 && errno == EINTR))
+          continue;
+        int error = -1;
+        socklen_t length = sizeof(error);
+        connected = ready == 1 &&
+                    getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0;
+        break;
+      }
+    }
+    return connected && fcntl(fd, F_SETFL, flags) != -1;
+  }
 
-  if (!screen && !gSDL.fuzz_mode) {
-    screen = gSDL.setVideoMode(y_width, y_height, SDL_DOUBLEBUF);
-    assert(screen);
+  bool stopping() {
+    SDL_LockMutex(mLock);
+    bool stopping = mStopping;
+    SDL_UnlockMutex(mLock);
+    return stopping;
   }
 
-  OggPlayVideoData* data = oggplay_callback_info_get_video_data(header);
+  // Reads from 'fd' up to 'length' bytes, giving up after TIMEOUT seconds
+  // without any or when stopping. Returns the number read, 0 at the end of
+  // the response or -1 on error.
+  ssize_t receiveSome(int fd, char* buffer, size_t length) {
+    for (int idle=0; idle < TIMEOUT; ++idle) {
+      ssize_t got = recv(fd, buffer, length, 0);
+      if (got >= 0)
+        return got;
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        return -1;
+      if (stopping())
+        return -1;
+    }
+    return -1;
+  }
 
-  if (gSDL.use_sdl_yuv && screen) {
-    if (!gSDL.yuv_surface) {
-      gSDL.yuv_surface = shared_ptr<SDL_Overlay>(
-                                                 SDL_CreateYUVOverlay(y_width,
-                                                                      y_height,
-                                                                      SDL_YV12_OVERLAY,
-                                                                      screen.get()),
-                                                 SDL_FreeYUVOverlay);
-      assert(gSDL.yuv_surface);
+  // Reads the response to a request for the bytes from 'begin' to 'end'
+  // into the cache. Returns false if it failed before it was complete.
+  bool receive(int fd, int64_t begin, int64_t end) {
+    vector<char> buffer(64 * 1024);
+    string headers;
+    size_t body;
+    while ((body = headers.find("\r\n\r\n")) == string::npos) {
+      ssize_t got = receiveSome(fd, &buffer[0], buffer.size());
+      if (got <= 0 || headers.size() > 64 * 1024)
+        return false;
+      headers.append(&buffer[0], got);
     }
 
-    r = SDL_LockYUVOverlay(gSDL.yuv_surface.get());
-    assert(r == 0);
+    // 206 with the range requested, or 200 with the whole stream if the
+    // server doesn't do ranges
+    int status = 0;
+    sscanf(headers.c_str(), "HTTP/%*s %d", &status);
+    int64_t start = status == 200 ? 0 : -1;
+    int64_t size = -1;
+    istringstream lines(headers.substr(0, body));
+    string line;
+    while (getline(lines, line)) {
+      long long first, last, total;
+      if (strncasecmp(line.c_str(), "Content-Range:", 14) == 0 &&
+          sscanf(line.c_str() + 14, " bytes %lld-%lld/%lld", &first, &last, &total) == 3) {
+        start = first;
+        size = total;
+      }
+      else if (status == 200 && strncasecmp(line.c_str(), "Content-Length:", 15) == 0 &&
+               sscanf(line.c_str() + 15, " %lld", &total) == 1) {
+        size = total;
+      }
+    }
+    if ((status != 200 && status != 206) || start < 0 || start > begin)
+      return false;
 
-    memcpy(gSDL.yuv_surface->pixels[0], data->y, gSDL.yuv_surface->pitches[0] * y_height);
-    memcpy(gSDL.yuv_surface->pixels[2], data->u, gSDL.yuv_surface->pitches[2] * uv_height);
-    memcpy(gSDL.yuv_surface->pixels[1], data->v, gSDL.yuv_surface->pitches[1] * uv_height);
+    SDL_LockMutex(mLock);
+    if (size != -1)
+      mSize = size;
+    mStarted = true;
+    SDL_CondBroadcast(mArrived);
+    SDL_UnlockMutex(mLock);
+
+    // Position in the stream of the next byte of the body
+    int64_t position = start;
+    string data = headers.substr(body + 4);
+    size_t slot = 0;
+    for (;;) {
+      size_t used = 0;
+      if (position < begin) {
+        used = size_t(min(int64_t(data.size()), begin - position));
+        position += used;
+      }
+      while (used < data.size()) {
+        int64_t block = position / BLOCK;
+        int offset = position % BLOCK;
+        SDL_LockMutex(mLock);
+        if (offset == 0 || position == begin) {
+          // Stop at blocks that are no longer wanted or already here
+          if (mStopping || (position != begin && (!inWindow(block) || complete(block)))) {
+            if (block < mWantBlock || block > mWantBlock + READAHEAD)
+              ++mAbandoned;
+            SDL_UnlockMutex(mLock);
+            return true;
+          }
+          slot = allocate(block) - &mSlots[0];
+        }
+        int length = blockLength(block);
+        SDL_UnlockMutex(mLock);
+
+        size_t n = min(data.size() - used, size_t(length - offset));
+        if (pwrite(mCacheFd, data.data() + used, n, off_t(slot) * BLOCK + offset) != ssize_t(n))
+          return false;
+        used += n;
+        position += n;
+
+        // Only this thread fills or reuses slots, so 'slot' still holds
+        // 'block'
+        SDL_LockMutex(mLock);
+        mBytesFetched += n;
+        mSlots[slot].filled = max(mSlots[slot].filled, int(offset + n));
+        SDL_CondBroadcast(mArrived);
+        SDL_UnlockMutex(mLock);
+      }
 
-    SDL_UnlockYUVOverlay(gSDL.yuv_surface.get());
+      ssize_t got = receiveSome(fd, &buffer[0], buffer.size());
+      if (got < 0)
+        return false;
+      if (got == 0)
+        break;
+      data.assign(&buffer[0], got);
+    }
 
-    SDL_Rect rect;
-    rect.x = 0;
-    rect.y = 0;
-    rect.w = y_width;
-    rect.h = y_height;
-    SDL_DisplayYUVOverlay(gSDL.yuv_surface.get(), &rect);
-  } else {
-    OggPlayYUVChannels yuv;
-    yuv.ptry = data->y;
-    yuv.ptru = data->u;
-    yuv.ptrv = data->v;
-    yuv.uv_width = uv_width;
-    yuv.uv_height = uv_height;
-    yuv.y_width = y_width;
-    yuv.y_height = y_height;
+    // The response has ended. If the size of the stream wasn't given this
+    // is the end of it.
+    SDL_LockMutex(mLock);
+    if (mSize == -1)
+      mSize = position;
+    bool ended = position >= (end == -1 ? mSize : min(end, mSize));
+    SDL_CondBroadcast(mArrived);
+    SDL_UnlockMutex(mLock);
+    return ended;
+  }
 
-    int size = y_width * y_height * 4;
+  void report() {
+    cout << "HTTP reader: " << mBytesFetched / 1024 << " KB fetched in " << mRequests
+         << " requests (" << mAbandoned << " abandoned for seeks), " << mHits
+         << " reads from cache, " << mStalls << " reads waited " << mStallUs / 1000
+         << " ms for the network, " << mEvictions << " blocks evicted" << endl;
+  }
 
-    // The array is being allocated here on each frame. Should really do this once and
-    // reallocate when it changes.
-    scoped_array<unsigned char> buffer(new unsigned char[size]);
-    assert(buffer);
+  string mHost;
+  string mPort;
+  string mPath;
+
+  // Protects everything below except mPosition, which only the thread
+  // calling liboggplay uses
+  SDL_mutex* mLock;
+  // Signalled when data arrives or fetching fails
+  SDL_cond* mArrived;
+  // Signalled when the read position moves to another block
+  SDL_cond* mWanted;
+  SDL_Thread* mThread;
+  bool mStopping;
+  // The server's addresses, once looked up
+  addrinfo* mAddresses;
+
+  int mCacheFd;
+  vector<Slot> mSlots;
+  // Slot holding each cached block
+  map<int64_t, size_t> mBlocks;
+
+  // -1 until known
+  int64_t mSize;
+  // Set once the first response arrives
+  bool mStarted;
+  bool mFailed;
+
+  int64_t mPosition;
+  // Block holding mPosition, which starts the read ahead window
+  int64_t mWantBlock;
+  unsigned long mTick;
+
+  int64_t mBytesFetched;
+  long mRequests;
+  long mAbandoned;
+  long mHits;
+  long mStalls;
+  int64_t mStallUs;
+  long mEvictions;
+};
 
-    OggPlayRGBChannels rgb;
-    rgb.ptro = buffer.get();
-    rgb.rgb_width = y_width;
-    rgb.rgb_height = y_height;
+// Opens 'path', which may be a local file or an http:// URL. Returns a null
+// pointer if it can't be opened.
+shared_ptr<OggPlay> open_player(const char* path) {
+  // liboggplay doesn't take const char*
+  char* p = const_cast<char*>(path);
+  OggPlayReader* reader = 0;
+  if (strncmp(path, "http://", 7) == 0) 
+    reader = HttpReader::create(path);
+  else if (gReaderKind == READER_MMAP)
+    reader = MmapReader::create(path);
+  else
+    reader = oggplay_file_reader_new(p);
 
-#if SDL_BYTE_ORDER == SDL_BIG_ENDIAN
-    oggplay_yuv2argb(&yuv, &rgb);
-#else
-    oggplay_yuv2bgra(&yuv, &rgb);
-#endif
+  if (!reader)
+    return shared_ptr<OggPlay>();
 
-    shared_ptr<SDL_Surface> rgb_surface( 
-                                        SDL_CreateRGBSurfaceFrom(buffer.get(),
-                                                                 y_width,
-                                                                 y_height,
-                                                                 32,
-                                                                 4 * y_width,
-                                                                 0, 0, 0, 0),
-                                        SDL_FreeSurface);
-    assert(rgb_surface);
-
-    if (screen) {
-      r = SDL_BlitSurface(rgb_surface.get(), 
-			  NULL,
-			  screen.get(),
-			  NULL);
-      assert(r == 0);
+  OggPlay* player = oggplay_open_with_reader(reader);
+  if (!player)
+    return shared_ptr<OggPlay>();
+  return shared_ptr<OggPlay>(player, oggplay_close);
+}
+
+// Activates the chosen tracks and sets up how liboggplay delivers their data.
+void activate_tracks(shared_ptr<OggPlay> player, shared_ptr<TheoraTrack> video,
+                     shared_ptr<VorbisTrack> audio, shared_ptr<KateTrack> kate,
+                     bool verbose) {
+  if (video) {
+    video->setActive();
+    oggplay_set_callback_num_frames(player.get(), video->mIndex, 1);
+    if (verbose)
+      cout << "  " << video->toString() << endl;
+  }
+
+  if (audio) {
+    audio->setActive();
+    if (!video)
+      oggplay_set_callback_num_frames(player.get(), audio->mIndex, 2048);
+
+    if (verbose)
+      cout << "  " << audio->toString() << endl;
+  }
+
+  if (kate) {
+    kate->setActive();
+    if (video) {
+      // Rendered at the size frames are shown at and blended onto them by
+      // the Presenter, so the video stays YUV
+      int y_width = 0, y_height = 0, uv_width = 0, uv_height = 0;
+      oggplay_get_video_y_size(player.get(), video->mIndex, &y_width, &y_height);
+      oggplay_get_video_uv_size(player.get(), video->mIndex, &uv_width, &uv_height);
+      int width = y_width, height = y_height, w, h;
+      gScalePolicy.fit(y_width, y_height, uv_width, uv_height, width, height, w, h);
+      oggplay_set_kate_tiger_rendering(player.get(), kate->mIndex, 1, 0, width, height);
+    }
+    else {
+      oggplay_set_kate_tiger_rendering(player.get(), kate->mIndex, 1, 0, 640, 480);
     }
+    if (!audio && !video)
+      oggplay_set_callback_period(player.get(), kate->mIndex, 40);
+
+    if (verbose)
+      cout << "  " << kate->toString() << endl;
+  }
+}
+
+// Returns true if 'name' looks like an Ogg file
+bool has_ogg_extension(const string& name) {
+  static const char* extensions[] = { ".ogg", ".ogv", ".oga", ".ogx", ".spx" };
+  for (size_t i=0; i < sizeof(extensions) / sizeof(extensions[0]); ++i) {
+    size_t len = strlen(extensions[i]);
+    if (name.size() > len && strcasecmp(name.c_str() + name.size() - len, extensions[i]) == 0)
+      return true;
+  }
+  return false;
+}
+
+// Adds 'path' to 'files'. Directories are searched recursively for Ogg files.
+void collect_files(const string& path, vector<string>& files) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+    files.push_back(path);
+    return;
   }
 
-  if (screen) {
-    seekBar.draw(screen);
-
-    r = SDL_Flip(screen.get());
-    assert(r == 0);
+  DIR* dir = opendir(path.c_str());
+  if (!dir) {
+    cerr << "Can't read directory " << path << endl;
+    return;
+  }
+  vector<string> entries;
+  while (struct dirent* entry = readdir(dir)) {
+    string name(entry->d_name);
+    if (name == "." || name == "..")
+      continue;
+    entries.push_back(path + "/" + name);
+  }
+  closedir(dir);
+
+  sort(entries.begin(), entries.end());
+  for (size_t i=0; i < entries.size(); ++i) {
+    if (stat(entries[i].c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+      collect_files(entries[i], files);
+    else if (has_ogg_extension(entries[i]))
+      files.push_back(entries[i]);
   }
 }
 
-// Process the RGB(A) video data provided by liboggplay.
-void handle_overlay_data(shared_ptr<SDL_Surface>& screen, 
-                         SeekBar& seekBar,
-                         shared_ptr<Track> video, 
-                         OggPlayDataHeader* header) {
-  shared_ptr<OggPlay> player(video->mPlayer);
-  OggPlayOverlayData* data = oggplay_callback_info_get_overlay_data(header);
+// Outcome of decoding one file in batch mode
+struct BatchResult {
+  BatchResult() : videoFrames(0), audioSamples(0), seconds(0) { }
 
-  int width = data->width, height = data->height;
+  string path;
+  string tracks;
+  long videoFrames;
+  int64_t audioSamples;
+  string error;
+  double seconds;
+};
 
-  if (!screen) {
-    screen = gSDL.setVideoMode(width, height, SDL_DOUBLEBUF);
-    assert(screen);
+// Decodes many files headless, as in --fuzz-mode, each with its own OggPlay
+// and Decoder, on a pool of worker threads.
+class BatchDecoder {
+public:
+  BatchDecoder(const vector<string>& paths, int jobs, int videoTrack, int audioTrack, int kateTrack)
+    : mResults(paths.size()),
+      mNext(0),
+      mJobs(jobs),
+      mVideoTrack(videoTrack),
+      mAudioTrack(audioTrack),
+      mKateTrack(kateTrack),
+      mLock(SDL_CreateMutex())
+  {
+    for (size_t i=0; i < paths.size(); ++i)
+      mResults[i].path = paths[i];
   }
 
-  void *buffer = data->rgb ? data->rgb : data->rgba;
-  shared_ptr<SDL_Surface> rgb_surface( 
-    SDL_CreateRGBSurfaceFrom(buffer,
-                             width,
-                             height,
-                             32,
-                             4 * width,
-                             0, 0, 0, 0),
-    SDL_FreeSurface);
-  assert(rgb_surface);
+  ~BatchDecoder() {
+    SDL_DestroyMutex(mLock);
+  }
 
-  int r = SDL_BlitSurface(rgb_surface.get(), 
-                      NULL,
-                      screen.get(),
-                      NULL);
-  assert(r == 0);
+  void run() {
+    int64_t start = now_us();
+    vector<SDL_Thread*> threads;
+    int jobs = std::min<size_t>(mJobs, mResults.size());
+    for (int i=0; i < jobs; ++i) {
+      SDL_Thread* thread = SDL_CreateThread(worker, this);
+      assert(thread);
+      threads.push_back(thread);
+    }
+    for (size_t i=0; i < threads.size(); ++i)
+      SDL_WaitThread(threads[i], NULL);
+    mSeconds = (now_us() - start) / 1000000.0;
+  }
 
-  seekBar.draw(screen);
+  // Prints a table of per-file results and returns the number of files that
+  // had errors.
+  int report() const {
+    int failures = 0;
+    double cpu_seconds = 0;
+    cout << left << setw(48) << "file" << " " << setw(8) << "tracks" << " "
+         << right << setw(8) << "frames" << " " << setw(12) << "samples" << " "
+         << setw(9) << "seconds" << "  error" << endl;
+    for (size_t i=0; i < mResults.size(); ++i) {
+      const BatchResult& r = mResults[i];
+      cout << left << setw(48) << r.path << " " << setw(8) << r.tracks << " "
+           << right << setw(8) << r.videoFrames << " " << setw(12) << r.audioSamples << " "
+           << setw(9) << fixed << setprecision(3) << r.seconds << "  " << r.error << endl;
+      cout.unsetf(ios_base::floatfield);
+      if (!r.error.empty())
+        ++failures;
+      cpu_seconds += r.seconds;
+    }
+    cout << mResults.size() << " files, " << failures << " with errors, "
+         << mSeconds << " s wall time (" << cpu_seconds << " s summed over files, "
+         << mJobs << " jobs)" << endl;
+    return failures;
+  }
 
-  r = SDL_Flip(screen.get());
-  assert(r == 0);
-}
+private:
+  static int worker(void* p) {
+    BatchDecoder* batch = static_cast<BatchDecoder*>(p);
+    size_t index;
+    while (batch->next(index))
+      batch->decode(batch->mResults[index]);
+    return 0;
+  }
 
-// Process the text from a Kate stream (when not already overlaid on video).
-void handle_text_data( shared_ptr<KateTrack> kate, 
-                       OggPlayTextData* header) {
-  cout << (const char*)header << endl;
-}
+  bool next(size_t& index) {
+    SDL_LockMutex(mLock);
+    bool more = mNext < mResults.size();
+    if (more)
+      index = mNext++;
+    SDL_UnlockMutex(mLock);
+    return more;
+  }
 
-// Handle key events. Return 'false' to exit the
-// play loop.
-bool handle_key_press(shared_ptr<SDL_Surface> screen, SDL_Event const& event) {
-  if (event.key.keysym.sym == SDLK_ESCAPE)
-    return false;
-  else if(event.key.keysym.sym == SDLK_SPACE) 
-    SDL_WM_ToggleFullScreen(screen.get());
+  void decode(BatchResult& result) {
+    int64_t start = now_us();
+    shared_ptr<OggPlay> player(open_player(result.path.c_str()));
+    if (!player) {
+      result.error = "open failed";
+    }
+    else {
+      vector<shared_ptr<Track> > tracks;
+      load_metadata(player, back_inserter(tracks));
+      shared_ptr<TheoraTrack> video(get_track<TheoraTrack>(mVideoTrack, tracks.begin(), tracks.end()));
+      shared_ptr<VorbisTrack> audio(get_track<VorbisTrack>(mAudioTrack, tracks.begin(), tracks.end()));
+      shared_ptr<KateTrack> kate(get_track<KateTrack>(mKateTrack, tracks.begin(), tracks.end()));
+      result.tracks = string(video ? "T" : "") + (audio ? "V" : "") + (kate ? "K" : "");
+
+      if (!video && !audio && !kate) {
+        result.error = "no playable tracks";
+      }
+      else {
+        activate_tracks(player, video, audio, kate, false);
+        PlayResult played = play(player, audio, video, kate, false);
+        result.videoFrames = played.videoFrames;
+        result.audioSamples = played.audioSamples;
+        if (played.decodeResult < 0 && played.decodeResult != E_OGGPLAY_TIMEOUT) {
+          ostringstream str;
+          str << "decode error " << played.decodeResult;
+          result.error = str.str();
+        }
+      }
+    }
+    result.seconds = (now_us() - start) / 1000000.0;
+  }
 
-  return true;
-}
+  vector<BatchResult> mResults;
+  size_t mNext;
+  int mJobs;
+  int mVideoTrack;
+  int mAudioTrack;
+  int mKateTrack;
+  SDL_mutex* mLock;
+  double mSeconds;
+};
 
-// Handle any SDL events. Returning 'false' will
-// exit the play loop.
-bool handle_sdl_event(shared_ptr<SDL_Surface> screen, SDL_Event const& event) {
-  switch (event.type) {
-    case SDL_KEYDOWN:
-      return handle_key_press(screen, event);
-    case SDL_QUIT:
-      // Application window was closed.
-      return false;
-    default:
-      return true;
+// Quotes 's' as a JSON string
+string json_string(const string& s) {
+  ostringstream str;
+  str << '"';
+  for (size_t i=0; i < s.size(); ++i) {
+    unsigned char c = s[i];
+    if (c == '"' || c == '\\')
+      str << '\\' << c;
+    else if (c < 0x20)
+      str << "\\u" << hex << setw(4) << setfill('0') << int(c) << dec << setfill(' ');
+    else
+      str << c;
   }
+  str << '"';
+  return str.str();
 }
 
-// Play the tracks. Exits when the longest track has completed playing
-void play(shared_ptr<OggPlay> player, shared_ptr<VorbisTrack> audio, shared_ptr<TheoraTrack> video,
-          shared_ptr<KateTrack> kate) {
-  // Video Surface. We delay creating it until we've decoded some of the
-  // video stream so we can get the width/height.
-  shared_ptr<SDL_Surface> screen;
-
-  // Open an audio stream
-  shared_ptr<sa_stream_t> sound(static_cast<sa_stream_t*>(NULL), sa_stream_destroy);
+// Reads the track layout and duration of many files, several at once, and
+// writes one line of JSON per file to stdout as each finishes. Only the
+// file names are held for the whole run, and each worker has one file open
+// at a time, so memory stays bounded however many files there are. Nothing
+// is decoded beyond what finding the duration needs, and SDL's video and
+// audio are never started.
+class Prober {
+public:
+  // How many callbacks to step through looking for the first decoded data
+  // before giving up on a file's duration
+  enum { MAX_STEPS = 1000 };
+
+  Prober(const vector<string>& paths, int jobs, bool useCache)
+    : mPaths(paths),
+      mNext(0),
+      mJobs(jobs),
+      mUseCache(useCache),
+      mFailures(0),
+      mLock(SDL_CreateMutex())
+  {
+  }
 
-  if (audio && !gSDL.fuzz_mode) {
-    sa_stream_t* s;
-    int sr = sa_stream_create_pcm(&s,
-                                  NULL,
-                                  SA_MODE_WRONLY,
-                                  SA_PCM_FORMAT_S16_NE,
-                                  audio->mRate,
-                                  audio->mChannels);
-    assert(sr == SA_SUCCESS);
-    sound.reset(s, sa_stream_destroy);
+  ~Prober() {
+    SDL_DestroyMutex(mLock);
+  }
 
-    sr = sa_stream_open(sound.get());
-    //assert(sr == SA_SUCCESS);
-    if (sr != SA_SUCCESS) {
-      cerr << "Failed to open sound" << endl;
+  void run() {
+    int64_t start = now_us();
+    vector<SDL_Thread*> threads;
+    int jobs = std::min<size_t>(mJobs, mPaths.size());
+    for (int i=0; i < jobs; ++i) {
+      SDL_Thread* thread = SDL_CreateThread(worker, this);
+      assert(thread);
+      threads.push_back(thread);
     }
+    for (size_t i=0; i < threads.size(); ++i)
+      SDL_WaitThread(threads[i], NULL);
+    mSeconds = (now_us() - start) / 1000000.0;
   }
 
-  int r = oggplay_use_buffer(player.get(), 20);
-  assert(r == E_OGGPLAY_OK);
-
-  // Event object for SDL
-  SDL_Event event;
-
-  // The time that we started playing - used for synching a/v against
-  // the system clock.
-  // TODO: sync vs audio clock
-  ptime start(microsec_clock::universal_time());
-
-  // Start the decoding loop in a background thread. The thread must
-  // be stopped before this function is exited so that the player
-  // object is not being used when it is deleted.
-  Decoder decoder(player);
-
-  SeekBar seekBar(player, decoder, seconds(5), 10, 10, 1);
-  long first_frame_time = -1;
-
-  if (!decoder.start())
-    return;
+  // Summarises the run on stderr, keeping stdout for the JSON, and returns
+  // the number of files that couldn't be read.
+  int report() const {
+    cerr << "Probed " << mPaths.size() << " files, " << mFailures << " failed, "
+         << mSeconds << " s wall time, " << mJobs << " jobs" << endl;
+    return mFailures;
+  }
 
-  while (!decoder.isCompleted()) {
-    while (SDL_PollEvent(&event) == 1) {
-      if (!seekBar.handleEvent(screen, event) &&
-          !handle_sdl_event(screen, event)) {
-        decoder.setCompleted(true);
-        break;
-      }
+private:
+  static int worker(void* p) {
+    Prober* prober = static_cast<Prober*>(p);
+    size_t index;
+    while (prober->next(index)) {
+      bool ok;
+      string line = prober->probe(prober->mPaths[index], ok);
+      prober->write(line, ok);
     }
-    if (decoder.isCompleted())
-      break;
+    return 0;
+  }
 
-    OggPlayCallbackInfo** info = oggplay_buffer_retrieve_next(player.get());
-    if (!info)
-     continue;
+  bool next(size_t& index) {
+    SDL_LockMutex(mLock);
+    bool more = mNext < mPaths.size();
+    if (more)
+      index = mNext++;
+    SDL_UnlockMutex(mLock);
+    return more;
+  }
 
-    int num_tracks = oggplay_get_num_tracks(player.get());
-    assert(!audio || audio && audio->mIndex < num_tracks);
-    assert(!video || video && video->mIndex < num_tracks);
-    assert(!kate || kate && kate->mIndex < num_tracks);
+  void write(const string& line, bool ok) {
+    SDL_LockMutex(mLock);
+    cout << line << endl;
+    if (!ok)
+      ++mFailures;
+    SDL_UnlockMutex(mLock);
+  }
 
-    if (audio && oggplay_callback_info_get_type(info[audio->mIndex]) == OGGPLAY_FLOATS_AUDIO) {
-      OggPlayDataHeader** headers = oggplay_callback_info_get_headers(info[audio->mIndex]);
-      double time = oggplay_callback_info_get_presentation_time(headers[0]) / 1000.0;
-      int required = oggplay_callback_info_get_required(info[audio->mIndex]);
-      for (int i=0; i<required;++i) {
-        int size = oggplay_callback_info_get_record_size(headers[i]);
-        OggPlayAudioData* data = oggplay_callback_info_get_audio_data(headers[i]);
-        if (sound) {
-          handle_audio_data(sound, data, size * audio->mChannels);
-        }
-      }
+  // Returns the JSON line for 'path'
+  string probe(const string& path, bool& ok) {
+    int64_t start = now_us();
+    ostringstream str;
+    str << "{\"path\":" << json_string(path);
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0)
+      str << ",\"size\":" << int64_t(st.st_size);
+
+    ok = false;
+    shared_ptr<OggPlay> player(open_player(path.c_str()));
+    if (!player) {
+      str << ",\"error\":\"open failed\"}";
+      return str.str();
     }
-    
-    if (video || kate) {
-      int idx = video ? video->mIndex : kate->mIndex;
-      int required = oggplay_callback_info_get_required(info[idx]);
-      if (required > 0) {
-        int type = oggplay_callback_info_get_type(info[idx]);
-        if (type == OGGPLAY_YUV_VIDEO || type == OGGPLAY_RGBA_VIDEO) {
-          OggPlayDataHeader** headers = oggplay_callback_info_get_headers(info[idx]);
-          long video_ms = oggplay_callback_info_get_presentation_time(headers[0]);
 
-          if (first_frame_time == -1) {
-            first_frame_time = video_ms;
-            seekBar.setStartTime(first_frame_time);
-          }
-          seekBar.setCurrentTime(video_ms);
-
-          if (decoder.justSeeked()) {
-            first_frame_time = video_ms;
-            start = microsec_clock::universal_time();
-          }
-
-          ptime now(microsec_clock::universal_time());
-          time_duration duration(now - start);
-          long system_ms = duration.total_milliseconds();
-          long diff = video_ms - first_frame_time - system_ms;
+    // The sidecar cache has the duration and tracks of files that have been
+    // played or probed before
+    SidecarCache cache;
+    MediaInfo info;
+    info.useIndex = false;
+    if (!mUseCache || !cache.load(path, player, info))
+      load_metadata(player, back_inserter(info.tracks));
+    if (info.durationMs == -1) {
+      int64_t scan_start = now_us();
+      info.durationMs = duration(player, info.tracks);
+      info.durationScanUs = now_us() - scan_start;
+    }
+    if (mUseCache)
+      cache.store(path, info);
 
-          if (diff > 0 && !gSDL.fuzz_mode) {
-            // Need to pause for a bit until it's time for the video frame to appear
-            SDL_Delay(diff);
-          }
+    if (info.durationMs >= 0)
+      str << ",\"duration_ms\":" << info.durationMs;
+    else
+      str << ",\"duration_ms\":null";
+    str << ",\"cached\":" << (info.cached ? "true" : "false") << ",\"tracks\":[";
+    for (size_t i=0; i < info.tracks.size(); ++i) {
+      if (i > 0)
+        str << ',';
+      writeTrack(str, player, info.tracks[i]);
+    }
+    str << "],\"probe_us\":" << now_us() - start << '}';
+    ok = true;
+    return str.str();
+  }
 
-          // Note that we pass the screen by reference here to allow it to be changed if the
-          // video changes size.
-          shared_ptr<Track> track = video;
-          if (!track) track = kate;
-          if (type == OGGPLAY_YUV_VIDEO) {
-            handle_video_data(screen, seekBar, track, headers[0]);
-          }
-          else if (type == OGGPLAY_RGBA_VIDEO) {
-            printf("handle_overlay_data()\n");
-            handle_overlay_data(screen, seekBar, track, headers[0]);
-          }
-        }
-      }
+  static void writeTrack(ostream& out, shared_ptr<OggPlay> player, shared_ptr<Track> track) {
+    out << "{\"index\":" << track->mIndex;
+    if (shared_ptr<TheoraTrack> theora = dynamic_pointer_cast<TheoraTrack>(track)) {
+      int width = 0, height = 0;
+      oggplay_get_video_y_size(player.get(), track->mIndex, &width, &height);
+      out << ",\"type\":\"theora\",\"fps\":";
+      // A zero denominator in the headers gives an infinite or NaN rate
+      if (theora->mFramerate >= 0 && theora->mFramerate < numeric_limits<double>::infinity())
+        out << theora->mFramerate;
+      else
+        out << "null";
+      out << ",\"width\":" << width << ",\"height\":" << height;
     }
+    else if (shared_ptr<VorbisTrack> vorbis = dynamic_pointer_cast<VorbisTrack>(track)) {
+      out << ",\"type\":\"vorbis\",\"rate\":" << vorbis->mRate
+          << ",\"channels\":" << vorbis->mChannels;
+    }
+    else if (shared_ptr<KateTrack> kate = dynamic_pointer_cast<KateTrack>(track)) {
+      out << ",\"type\":\"kate\",\"language\":" << json_string(kate->mLanguage)
+          << ",\"category\":" << json_string(kate->mCategory);
+    }
+    else {
+      const char* name = oggplay_get_track_typename(player.get(), track->mIndex);
+      out << ",\"type\":\"unknown\",\"name\":" << json_string(name ? name : "");
+    }
+    out << '}';
+  }
 
-    if (kate && oggplay_callback_info_get_type(info[kate->mIndex]) == OGGPLAY_KATE) {
-      OggPlayDataHeader** headers = oggplay_callback_info_get_headers(info[kate->mIndex]);
-      double time = oggplay_callback_info_get_presentation_time(headers[0]) / 1000.0;
-      int required = oggplay_callback_info_get_required(info[kate->mIndex]);
-      for (int i=0; i<required;++i) {
-        OggPlayTextData* data = oggplay_callback_info_get_text_data(headers[i]);
-        handle_text_data(kate, data);
+  // Finds the duration of a file that no data has been decoded from yet.
+  // Because of the liboggplay bug noted in SeekBar, the first video frame or
+  // audio record is decoded before asking. Returns -1 if there's nothing to
+  // decode.
+  static int64_t duration(shared_ptr<OggPlay> player, vector<shared_ptr<Track> >& tracks) {
+    shared_ptr<TheoraTrack> video(get_track<TheoraTrack>(UNSELECTED, tracks.begin(), tracks.end()));
+    shared_ptr<VorbisTrack> audio;
+    if (!video)
+      audio = get_track<VorbisTrack>(UNSELECTED, tracks.begin(), tracks.end());
+    if (!video && !audio)
+      return -1;
+    activate_tracks(player, video, audio, shared_ptr<KateTrack>(), false);
+    int r = oggplay_use_buffer(player.get(), 2);
+    assert(r == E_OGGPLAY_OK);
+
+    for (int step=0; step < MAX_STEPS; ++step) {
+      OggPlayCallbackInfo** info = oggplay_buffer_retrieve_next(player.get());
+      if (info) {
+        oggplay_buffer_release(player.get(), info);
+        return oggplay_get_duration(player.get());
       }
+      r = oggplay_step_decoding(player.get());
+      if (r != E_OGGPLAY_CONTINUE && r != E_OGGPLAY_USER_INTERRUPT && r != E_OGGPLAY_TIMEOUT)
+        break;
     }
-    
-    oggplay_buffer_release(player.get(), info);
-  } 
- 
-  // The decoding thread can be blocked in the call to oggplay_step_decoding.
-  // The following call will cause the thread blocked on that function to unblock
-  // and exit the decoding loop. We then join to the thread to ensure it has
-  // completed before we return so that player object can safely be deleted.
-  oggplay_prepare_for_close(player.get());
-  decoder.stop();
-}
+    return -1;
+  }
+
+  const vector<string>& mPaths;
+  size_t mNext;
+  int mJobs;
+  bool mUseCache;
+  int mFailures;
+  SDL_mutex* mLock;
+  double mSeconds;
+};
 
 void usage() {
     cout << "Usage: oggplayer [options] <filename>" << endl;
+    cout << "       oggplayer --batch [options] <file or directory>..." << endl;
+    cout << "       oggplayer --probe [options] <file or directory>..." << endl;
     cout << "  --sdl-yuv            Use SDL's YUV conversion routines" << endl;
+    cout << "  --present=<direct|blit> Convert frames straight into the screen when its" << endl;
+    cout << "                       format allows (default) or always blit them" << endl;
+    cout << "  --no-convert-ahead   Convert frames when they're due rather than before" << endl;
+    cout << "                       waiting for them, for comparing presentation jitter" << endl;
     cout << "  --fuzz-mode          Disable A/V sync and frame display" << endl;
+    cout << "  --benchmark          Decode headless as fast as possible and report" << endl;
+    cout << "                       throughput and per-stage latency" << endl;
+    cout << "  --batch              Decode every file given (directories are searched" << endl;
+    cout << "                       for Ogg files) headless and print a summary" << endl;
+    cout << "  --probe              Print each file's tracks and duration as a line of" << endl;
+    cout << "                       JSON, without playing it (directories are searched)" << endl;
+    cout << "  --jobs=<n>           Worker threads for --batch and --probe (default: one" << endl;
+    cout << "                       per core)" << endl;
+    cout << "  --no-seek-index      Don't index keyframes; seeks bisect the file" << endl;
+    cout << "  --no-cache           Don't read or write the sidecar cache of durations," << endl;
+    cout << "                       track metadata and keyframe indexes" << endl;
+    cout << "  --no-thumbnails      Don't show thumbnails when hovering over the seek bar" << endl;
+    cout << "  --reader=<file|mmap> Read local files with stdio (default) or by mapping" << endl;
+    cout << "                       them into memory" << endl;
+    cout << "  --http-cache=<MB>    Disk used to cache an http:// stream (default: 256)" << endl;
+    cout << "  --buffer-budget=<MB> Memory for decoded frames buffered ahead of playback" << endl;
+    cout << "                       (default: up to 2 seconds, at most 256 MB)" << endl;
+    cout << "  --sync=<audio|system>" << endl;
+    cout << "                       Clock to sync video against (default audio)" << endl;
+    cout << "  --frame-drop=<never|late|catchup>" << endl;
+    cout << "                       Policy for frames that are late (default late)" << endl;
+    cout << "  --drop-threshold=<ms>" << endl;
+    cout << "                       Drop frames later than this (default 50)" << endl;
+    cout << "  --catchup-threshold=<ms>" << endl;
+    cout << "                       Seek ahead when this late in catchup mode (default 1000)" << endl;
+    cout << "  --yuv-converter=<oggplay|scalar|sse2|avx2|auto>" << endl;
+    cout << "                       Select the YUV to RGB conversion routine (default oggplay)" << endl;
+    cout << "  --yuv-matrix=<bt601|bt709>" << endl;
+    cout << "                       Colour matrix for our own YUV converters (default bt601)" << endl;
+    cout << "  --convert-threads=<n>" << endl;
+    cout << "                       Threads converting each large frame (default: processors," << endl;
+    cout << "                       at most 8)" << endl;
+    cout << "  --size=<W>x<H>       Scale larger frames down to fit before converting them" << endl;
+    cout << "  --scale-filter=<nearest|bilinear|box>" << endl;
+    cout << "                       Filter for --size (default bilinear)" << endl;
+    cout << "  --yuv-benchmark      Compare the YUV converters on this machine and exit" << endl;
+    cout << "  --audio-converter=<scalar|sse2|avx2|auto>" << endl;
+    cout << "                       Select the float to S16 sample conversion routine" << endl;
+    cout << "  --audio-converter-test" << endl;
+    cout << "                       Check the vector sample converters against the" << endl;
+    cout << "                       scalar one and exit, non-zero on a mismatch" << endl;
     cout << "  --video-track <n>    Select which video track to use (-1 to disable)" << endl;
     cout << "  --audio-track <n>    Select which audio track to use (-1 to disable)" << endl;
     cout << "  --kate-track <n>     Select which kate track to use (-1 to disable)" << endl;
@@ -841,22 +6622,160 @@ static int parse_track_index_parameter(int argc, char *argv[], int &n, const cha
   return 1;
 }
 
+// Parses a '--name=<ms>' option. Returns 0 if 'arg' was that option.
+static int parse_ms_parameter(const char* arg, const char* name, long& ms)
+{
+  size_t len = strlen(name);
+  if (strncmp(arg, name, len) == 0) {
+    char *end = NULL;
+    ms = strtol(arg + len, &end, 10);
+    if (*end || end == arg + len || ms < 0) usage();
+    return 0;
+  }
+  return 1;
+}
+
 int main(int argc, char* argv[]) {
   int video_track = UNSELECTED, audio_track = UNSELECTED, kate_track = UNSELECTED;
+  bool batch = false;
+  bool probe = false;
+  bool seek_index = true;
+  bool use_cache = true;
+  bool use_thumbnails = true;
+  long convert_threads = min(processor_count(), 8);
+  long jobs = processor_count();
+  vector<string> paths;
 
   if (argc < 2) {
     usage();
   }
 
-  char* path = NULL;
+#ifdef SIGUSR1
+  signal(SIGUSR1, handle_sigusr1);
+#endif
+
   for (int n=1; n<argc; ++n) {
     if (argv[n][0] == '-') {
       if (strcmp(argv[n], "--sdl-yuv") == 0) {
         gSDL.use_sdl_yuv = true;
       }
+      else if (strcmp(argv[n], "--present=direct") == 0) {
+        gSDL.present_direct = true;
+      }
+      else if (strcmp(argv[n], "--present=blit") == 0) {
+        gSDL.present_direct = false;
+      }
+      else if (strcmp(argv[n], "--no-convert-ahead") == 0) {
+        gSDL.convert_ahead = false;
+      }
       else if (strcmp(argv[n], "--fuzz-mode") == 0) {
         gSDL.fuzz_mode = true;
       }
+      else if (strcmp(argv[n], "--benchmark") == 0) {
+        gSDL.fuzz_mode = true;
+        gBenchmark.enabled = true;
+      }
+      else if (strcmp(argv[n], "--batch") == 0) {
+        batch = true;
+      }
+      else if (strcmp(argv[n], "--probe") == 0) {
+        probe = true;
+      }
+      else if (strncmp(argv[n], "--jobs=", 7) == 0) {
+        char *end = NULL;
+        jobs = strtol(argv[n] + 7, &end, 10);
+        if (*end || jobs < 1) usage();
+      }
+      else if (strcmp(argv[n], "--no-seek-index") == 0) {
+        seek_index = false;
+      }
+      else if (strcmp(argv[n], "--no-cache") == 0) {
+        use_cache = false;
+      }
+      else if (strcmp(argv[n], "--no-thumbnails") == 0) {
+        use_thumbnails = false;
+      }
+      else if (strncmp(argv[n], "--http-cache=", 13) == 0) {
+        char *end = NULL;
+        long mb = strtol(argv[n] + 13, &end, 10);
+        if (*end || end == argv[n] + 13 || mb < 1) usage();
+        gHttpCacheMB = mb;
+      }
+      else if (strcmp(argv[n], "--reader=file") == 0) {
+        gReaderKind = READER_FILE;
+      }
+      else if (strcmp(argv[n], "--reader=mmap") == 0) {
+        gReaderKind = READER_MMAP;
+      }
+      else if (strncmp(argv[n], "--buffer-budget=", 16) == 0) {
+        char *end = NULL;
+        gBufferPolicy.budgetMB = strtol(argv[n] + 16, &end, 10);
+        if (*end || end == argv[n] + 16 || gBufferPolicy.budgetMB < 1) usage();
+      }
+      else if (strcmp(argv[n], "--sync=audio") == 0) {
+        gSDL.audio_sync = true;
+      }
+      else if (strcmp(argv[n], "--sync=system") == 0) {
+        gSDL.audio_sync = false;
+      }
+      else if (strcmp(argv[n], "--frame-drop=never") == 0) {
+        gFrameDropPolicy.mode = DROP_NEVER;
+      }
+      else if (strcmp(argv[n], "--frame-drop=late") == 0) {
+        gFrameDropPolicy.mode = DROP_LATE;
+      }
+      else if (strcmp(argv[n], "--frame-drop=catchup") == 0) {
+        gFrameDropPolicy.mode = DROP_CATCHUP;
+      }
+      else if (!parse_ms_parameter(argv[n], "--drop-threshold=", gFrameDropPolicy.lateMs)) {
+      }
+      else if (!parse_ms_parameter(argv[n], "--catchup-threshold=", gFrameDropPolicy.catchupMs)) {
+      }
+      else if (strcmp(argv[n], "--yuv-converter=oggplay") == 0) {
+        gYUVConverter.selectOggplay();
+      }
+      else if (strncmp(argv[n], "--yuv-converter=", 16) == 0) {
+        SimdLevel level;
+        if (!parse_simd_level(argv[n] + 16, level))
+          usage();
+        gYUVConverter.select(level);
+      }
+      else if (strncmp(argv[n], "--convert-threads=", 18) == 0) {
+        char *end = NULL;
+        convert_threads = strtol(argv[n] + 18, &end, 10);
+        if (*end || end == argv[n] + 18 || convert_threads < 1) usage();
+      }
+      else if (strncmp(argv[n], "--size=", 7) == 0) {
+        char* end = NULL;
+        gScalePolicy.maxWidth = strtol(argv[n] + 7, &end, 10);
+        if (*end != 'x' || gScalePolicy.maxWidth < 1) usage();
+        const char* height = end + 1;
+        gScalePolicy.maxHeight = strtol(height, &end, 10);
+        if (*end || end == height || gScalePolicy.maxHeight < 1) usage();
+      }
+      else if (strncmp(argv[n], "--scale-filter=", 15) == 0) {
+        if (!parse_scale_filter(argv[n] + 15, gScalePolicy.filter))
+          usage();
+      }
+      else if (strcmp(argv[n], "--yuv-matrix=bt601") == 0) {
+        gYUVConverter.setMatrix(YUV_BT601);
+      }
+      else if (strcmp(argv[n], "--yuv-matrix=bt709") == 0) {
+        gYUVConverter.setMatrix(YUV_BT709);
+      }
+      else if (strcmp(argv[n], "--yuv-benchmark") == 0) {
+        benchmark_yuv_converters();
+        return 0;
+      }
+      else if (strcmp(argv[n], "--audio-converter-test") == 0) {
+        return test_audio_converters() ? EXIT_FAILURE : 0;
+      }
+      else if (strncmp(argv[n], "--audio-converter=", 18) == 0) {
+        SimdLevel level;
+        if (!parse_simd_level(argv[n] + 18, level))
+          usage();
+        gAudioConverter.select(level);
+      }
       else if (!parse_track_index_parameter(argc, argv, n, "--video-track", video_track)) {
       }
       else if (!parse_track_index_parameter(argc, argv, n, "--audio-track", audio_track)) {
@@ -868,72 +6787,106 @@ int main(int argc, char* argv[]) {
       }
     }
     else {
-      if (path) {
-        cerr << "Only one stream may be specified" << endl;
-      }
-      else {
-        path = (char*)argv[n]; // TODO: liboggplay bug doesn't take const char*
-      }
+      paths.push_back(argv[n]);
     }
   }
 
-  if (!path) {
-    usage();
+  if (probe) {
+    vector<string> files;
+    for (size_t i=0; i < paths.size(); ++i)
+      collect_files(paths[i], files);
+    if (files.empty())
+      usage();
+    Prober prober(files, jobs, use_cache);
+    prober.run();
+    return prober.report() ? EXIT_FAILURE : 0;
   }
 
-  OggPlayReader* reader = 0;
-  if (strncmp(path, "http://", 7) == 0) 
-    reader = oggplay_tcp_reader_new(path, NULL, 0);
-  else
-    reader = oggplay_file_reader_new(path);
+  if (batch) {
+    vector<string> files;
+    for (size_t i=0; i < paths.size(); ++i)
+      collect_files(paths[i], files);
+    if (files.empty())
+      usage();
+    gSDL.fuzz_mode = true;
+    BatchDecoder decoder(files, jobs, video_track, audio_track, kate_track);
+    decoder.run();
+    int failures = decoder.report();
+    gStats.dump();
+    return failures ? EXIT_FAILURE : 0;
+  }
+
+  if (paths.empty()) {
+    usage();
+  }
+  if (paths.size() > 1) {
+    cerr << "Only one stream may be specified" << endl;
+  }
 
-  assert(reader);
+  // Large frames are converted in bands across these threads. Batch mode
+  // decodes files in parallel instead.
+  gWorkers.start(convert_threads - 1);
+  gYUVConverter.setPool(&gWorkers);
 
-  shared_ptr<OggPlay> player(oggplay_open_with_reader(reader), oggplay_close);
+  shared_ptr<OggPlay> player(open_player(paths[0].c_str()));
   assert(player);
 
-  vector<shared_ptr<Track> > tracks;
-  load_metadata(player, back_inserter(tracks));
+  // Use what we found out about the file last time, if it hasn't changed
+  SidecarCache cache;
+  MediaInfo info;
+  info.useIndex = seek_index;
+  info.storing = use_cache;
+  if (!use_cache || !cache.load(paths[0], player, info)) {
+    int64_t start = now_us();
+    load_metadata(player, back_inserter(info.tracks));
+    info.metadataUs = now_us() - start;
+  }
+  vector<shared_ptr<Track> >& tracks = info.tracks;
   for_each(tracks.begin(), tracks.end(), dump_track);
 
+  // Index the file for seeking while it plays. Benchmarks don't seek, and the
+  // index's reads would be counted against the reader.
+  if (seek_index && !info.indexCached && !gBenchmark.enabled)
+    info.index.start(paths[0]);
+
+  if (gBenchmark.enabled) {
+    struct stat st;
+    if (paths[0].compare(0, 7, "http://") == 0)
+      gBenchmark.reader = "http";
+    else if (gReaderKind == READER_MMAP)
+      gBenchmark.reader = "mmap";
+    if (stat(paths[0].c_str(), &st) == 0)
+      gBenchmark.inputBytes = st.st_size;
+  }
+
   shared_ptr<TheoraTrack> video(get_track<TheoraTrack>(video_track, tracks.begin(), tracks.end()));
   shared_ptr<VorbisTrack> audio(get_track<VorbisTrack>(audio_track, tracks.begin(), tracks.end()));
   shared_ptr<KateTrack> kate(get_track<KateTrack>(kate_track, tracks.begin(), tracks.end()));
 
   cout << "Using the following tracks: " << endl;
-  if (video) {
-    video->setActive();
-    oggplay_set_callback_num_frames(player.get(), video->mIndex, 1);
-    cout << "  " << video->toString() << endl;
+  activate_tracks(player, video, audio, kate, true);
 
-  }
+  // Make seek bar thumbnails while it plays
+  ThumbnailCache thumbnails(64);
+  Thumbnailer thumbnailer(thumbnails);
+  use_thumbnails = use_thumbnails && video && !gSDL.fuzz_mode &&
+                   thumbnailer.start(paths[0], video->mIndex, seek_index ? &info.index : 0,
+                                     info.durationMs);
 
-  if (audio) {
-    audio->setActive();
-    if (!video)
-      oggplay_set_callback_num_frames(player.get(), audio->mIndex, 2048);
+  play(player, audio, video, kate, true, &info, use_thumbnails ? &thumbnails : 0);
 
-    cout << "  " << audio->toString() << endl;
+  if (use_thumbnails) {
+    thumbnailer.stop();
+    thumbnails.report();
   }
 
-  if (kate) {
-    kate->setActive();
-    if (video) {
-      oggplay_convert_video_to_rgb(player.get(), video->mIndex, 1, 0);
-      oggplay_overlay_kate_track_on_video(player.get(), kate->mIndex, video->mIndex);
-    }
-    else {
-      oggplay_set_kate_tiger_rendering(player.get(), kate->mIndex, 1, 0, 640, 480);
-    }
-    if (!audio && !video)
-      oggplay_set_callback_period(player.get(), kate->mIndex, 40);
-
-    cout << "  " << kate->toString() << endl;
+  if (use_cache) {
+    info.index.stop();
+    cache.store(paths[0], info);
+    cache.report(info);
   }
 
-
-  play(player, audio, video, kate);
-
+  gStats.dump();
   return 0;
 }
 // Copyright (C) 2009 Chris Double. All Rights Reserved.
@@ -0,0 +1,139 @@
+#!/usr/bin/env python3
+#
+# Checks oggplayer's HTTP reader against a server on the loopback
+# interface. The file given is served in several ways and decoded with
+# 'oggplayer --benchmark' from each of them. Every run has to decode the
+# same number of video frames and audio samples as the local file did.
+#
+#   range     206 responses to range requests
+#   short     206 responses cut short at 100KB, so the reader has to
+#             request the rest
+#   norange   200 with the whole file, ignoring Range
+#   evict     range requests with a 1MB cache, so that files larger than
+#             8MB have to evict blocks
+#
+# The HTTP reader's summary is printed after each run, with the number of
+# requests abandoned for seeks and blocks evicted.
+#
+# Usage: tools/http-check.py [--player=./oggplayer] <file.ogg>
+#
+# The exit status is non-zero if any run differed from the local file.
+
+import http.server
+import json
+import os
+import re
+import subprocess
+import sys
+import threading
+
+SHORT = 100 * 1024
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def log_message(self, *args):
+        pass
+
+    def do_GET(self):
+        server = self.server
+        server.requests += 1
+        if self.path != '/' + os.path.basename(server.file):
+            self.send_error(404)
+            return
+        size = len(server.data)
+        match = re.match(r'bytes=(\d+)-(\d*)$', self.headers.get('Range', ''))
+        if match and server.mode in ('range', 'short', 'evict'):
+            first = int(match.group(1))
+            last = int(match.group(2)) if match.group(2) else size - 1
+            last = min(last, size - 1)
+            if first >= size:
+                self.send_response(416)
+                self.send_header('Content-Range', 'bytes */%d' % size)
+                self.send_header('Content-Length', '0')
+                self.send_header('Connection', 'close')
+                self.end_headers()
+                return
+            if server.mode == 'short':
+                last = min(last, first + SHORT - 1)
+            self.send_response(206)
+            self.send_header('Content-Range', 'bytes %d-%d/%d' % (first, last, size))
+            body = server.data[first:last + 1]
+        else:
+            self.send_response(200)
+            body = server.data
+        self.send_header('Content-Length', str(len(body)))
+        self.send_header('Connection', 'close')
+        self.end_headers()
+        try:
+            self.wfile.write(body)
+        except (BrokenPipeError, ConnectionResetError):
+            # The reader hangs up on requests it abandons for a seek
+            pass
+
+def benchmark(player, args):
+    process = subprocess.run([player, '--benchmark', '--no-cache'] + args,
+                             stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                             universal_newlines=True)
+    result = None
+    report = ''
+    for line in process.stdout.splitlines():
+        if line.startswith('{'):
+            result = json.loads(line)
+        elif line.startswith('HTTP reader:'):
+            report = line
+    if process.returncode != 0 or result is None:
+        sys.stdout.write(process.stdout)
+        return None, report
+    return (result['video_frames'], result['audio_samples']), report
+
+def main():
+    player = './oggplayer'
+    files = []
+    for arg in sys.argv[1:]:
+        if arg.startswith('--player='):
+            player = arg[len('--player='):]
+        else:
+            files.append(arg)
+    if len(files) != 1:
+        sys.stderr.write('Usage: %s [--player=./oggplayer] <file.ogg>\n' % sys.argv[0])
+        return 2
+
+    server = http.server.ThreadingHTTPServer(('127.0.0.1', 0), Handler)
+    server.daemon_threads = True
+    server.file = files[0]
+    server.data = open(files[0], 'rb').read()
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    url = 'http://127.0.0.1:%d/%s' % (server.server_address[1], os.path.basename(files[0]))
+
+    expected, _ = benchmark(player, [files[0]])
+    if expected is None:
+        print('local: failed to decode %s' % files[0])
+        return 1
+    print('local: %d video frames, %d audio samples' % expected)
+
+    failures = 0
+    runs = [('range', []), ('short', []), ('norange', []), ('evict', ['--http-cache=1'])]
+    for mode, args in runs:
+        server.mode = mode
+        server.requests = 0
+        got, report = benchmark(player, args + [url])
+        if got != expected:
+            failures += 1
+            print('%s: FAILED, %s' % (mode, 'no result' if got is None else
+                                      '%d video frames, %d audio samples' % got))
+        elif (mode == 'evict' and len(server.data) > 8 * 1024 * 1024 and
+              re.search(r' 0 blocks evicted', report)):
+            failures += 1
+            print('%s: FAILED, nothing was evicted' % mode)
+        else:
+            print('%s: ok in %d requests' % (mode, server.requests))
+        if report:
+            print('  ' + report)
+
+    if len(server.data) <= 8 * 1024 * 1024:
+        print('evict: the file is 8MB or smaller, so nothing was evicted')
+    return 1 if failures else 0
+
+if __name__ == '__main__':
+    sys.exit(main())